@@ -19,18 +19,13 @@
  */
 #include "udp-multipath-router-helper.h"
 #include "ns3/udp-multipath-router.h"
-#include "ns3/uinteger.h"
 #include "ns3/names.h"
 
 namespace ns3 {
 
-UdpMultipathRouterHelper::UdpMultipathRouterHelper (uint16_t iport_0, uint16_t iport_1, uint16_t sport_0, uint16_t sport_1)
+UdpMultipathRouterHelper::UdpMultipathRouterHelper ()
 {
   m_factory.SetTypeId (UdpMultipathRouter::GetTypeId ());
-  SetAttribute ("IncomingPort0", UintegerValue (iport_0));
-  SetAttribute ("IncomingPort1", UintegerValue (iport_1));
-  SetAttribute ("SendingPort0", UintegerValue (sport_0));
-  SetAttribute ("SendingPort1", UintegerValue (sport_1));
 }
 
 void 
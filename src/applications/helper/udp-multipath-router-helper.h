@@ -38,12 +38,15 @@ class UdpMultipathRouterHelper
 {
 public:
   /**
-   * \param iport_0 
-   * \param iport_1 
-   * \param sport_0 
-   * \param sport_1 
+   * Routers are configured through their attributes: BalancingAlgorithm,
+   * DropMode, RefreshInterval, Channels and Paths, for example
+   *
+   *   UdpMultipathRouterHelper router;
+   *   router.SetAttribute ("Channels", StringValue ("0 100;1 50"));
+   *   router.SetAttribute ("Paths", StringValue ("10.1.1.1 9 10.1.2.2 9 1 0;10.1.1.1 9 10.1.3.2 9 1 1"));
+   *   router.Install (routerNodes);
    */
-  UdpMultipathRouterHelper (uint16_t iport0, uint16_t iport1, uint16_t sport_0, uint16_t sport_1);
+  UdpMultipathRouterHelper ();
 
   /**
    * Record an attribute to be set in each Application after it is is created.
@@ -78,8 +81,8 @@ public:
    * \param c The nodes on which to create the Applications.  The nodes
    *          are specified by a NodeContainer.
    *
-   * Create one udp echo server application on each of the Nodes in the
-   * NodeContainer.
+   * Create one UdpMultipathRouter on each of the Nodes in the NodeContainer,
+   * all configured with the attributes set so far.
    *
    * \returns The applications created, one Application per Node in the 
    *          NodeContainer.
@@ -0,0 +1,331 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright 2019 - Paolo, Eric
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "ns3/log.h"
+#include "udp-multipath-header.h"
+
+// channel id, delivered packets, delivered bytes, lost packets, probe seq, sent and hold time
+#define REPORT_ENTRY_SIZE (4 + 8 + 8 + 8 + 4 + 8 + 8)
+
+namespace ns3 {
+
+NS_LOG_COMPONENT_DEFINE ("UdpMultipathHeader");
+
+NS_OBJECT_ENSURE_REGISTERED (UdpMultipathHeader);
+NS_OBJECT_ENSURE_REGISTERED (UdpMultipathReportHeader);
+
+/* UdpMultipathHeader methods */
+UdpMultipathHeader::UdpMultipathHeader ()
+  : m_magic (MAGIC),
+    m_flags (0),
+    m_fecGroupSize (0),
+    m_fecIndex (0),
+    m_fecLength (0),
+    m_channelId (0),
+    m_channelSeq (0),
+    m_flowId (0),
+    m_flowSeq (0),
+    m_nodeId (0),
+    m_hopCount (0)
+{
+}
+
+bool
+UdpMultipathHeader::IsValid (void) const
+{
+  return m_magic == MAGIC;
+}
+void
+UdpMultipathHeader::SetFlags (uint8_t flags)
+{
+  m_flags = flags;
+}
+uint8_t
+UdpMultipathHeader::GetFlags (void) const
+{
+  return m_flags;
+}
+bool
+UdpMultipathHeader::IsParity (void) const
+{
+  return (m_flags & FLAG_PARITY) != 0;
+}
+bool
+UdpMultipathHeader::HasProbe (void) const
+{
+  return (m_flags & FLAG_PROBE) != 0;
+}
+void
+UdpMultipathHeader::SetFecGroupSize (uint8_t size)
+{
+  m_fecGroupSize = size;
+}
+uint8_t
+UdpMultipathHeader::GetFecGroupSize (void) const
+{
+  return m_fecGroupSize;
+}
+void
+UdpMultipathHeader::SetFecIndex (uint8_t index)
+{
+  m_fecIndex = index;
+}
+uint8_t
+UdpMultipathHeader::GetFecIndex (void) const
+{
+  return m_fecIndex;
+}
+void
+UdpMultipathHeader::SetFecLength (uint16_t length)
+{
+  m_fecLength = length;
+}
+uint16_t
+UdpMultipathHeader::GetFecLength (void) const
+{
+  return m_fecLength;
+}
+void
+UdpMultipathHeader::SetFlowId (uint32_t flow_id)
+{
+  m_flowId = flow_id;
+}
+uint32_t
+UdpMultipathHeader::GetFlowId (void) const
+{
+  return m_flowId;
+}
+void
+UdpMultipathHeader::SetFlowSeq (uint32_t seq)
+{
+  m_flowSeq = seq;
+}
+uint32_t
+UdpMultipathHeader::GetFlowSeq (void) const
+{
+  return m_flowSeq;
+}
+void
+UdpMultipathHeader::SetNodeId (uint32_t node_id)
+{
+  m_nodeId = node_id;
+}
+uint32_t
+UdpMultipathHeader::GetNodeId (void) const
+{
+  return m_nodeId;
+}
+void
+UdpMultipathHeader::SetHopCount (uint16_t hops)
+{
+  m_hopCount = hops;
+}
+uint16_t
+UdpMultipathHeader::GetHopCount (void) const
+{
+  return m_hopCount;
+}
+
+void
+UdpMultipathHeader::SetChannelId (uint32_t channel_id)
+{
+  m_channelId = channel_id;
+}
+uint32_t
+UdpMultipathHeader::GetChannelId (void) const
+{
+  return m_channelId;
+}
+void
+UdpMultipathHeader::SetChannelSeq (uint32_t seq)
+{
+  m_channelSeq = seq;
+}
+uint32_t
+UdpMultipathHeader::GetChannelSeq (void) const
+{
+  return m_channelSeq;
+}
+
+TypeId
+UdpMultipathHeader::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::UdpMultipathHeader")
+    .SetParent<Header> ()
+    .SetGroupName("Applications")
+    .AddConstructor<UdpMultipathHeader> ()
+  ;
+  return tid;
+}
+TypeId
+UdpMultipathHeader::GetInstanceTypeId (void) const
+{
+  return GetTypeId ();
+}
+void
+UdpMultipathHeader::Print (std::ostream &os) const
+{
+  os << "(flags=" << static_cast<uint32_t> (m_flags)
+     << " channel=" << m_channelId << " seq=" << m_channelSeq
+     << " flow=" << m_flowId << " flow_seq=" << m_flowSeq
+     << " fec_group=" << static_cast<uint32_t> (m_fecGroupSize)
+     << " fec_index=" << static_cast<uint32_t> (m_fecIndex)
+     << " node=" << m_nodeId << " hops=" << m_hopCount << ")";
+}
+uint32_t
+UdpMultipathHeader::GetSerializedSize (void) const
+{
+  return 1 + 1 + 1 + 1 + 2 + 4 + 4 + 4 + 4 + 4 + 2;
+}
+void
+UdpMultipathHeader::Serialize (Buffer::Iterator start) const
+{
+  Buffer::Iterator i = start;
+  i.WriteU8 (m_magic);
+  i.WriteU8 (m_flags);
+  i.WriteU8 (m_fecGroupSize);
+  i.WriteU8 (m_fecIndex);
+  i.WriteHtonU16 (m_fecLength);
+  i.WriteHtonU32 (m_channelId);
+  i.WriteHtonU32 (m_channelSeq);
+  i.WriteHtonU32 (m_flowId);
+  i.WriteHtonU32 (m_flowSeq);
+  i.WriteHtonU32 (m_nodeId);
+  i.WriteHtonU16 (m_hopCount);
+}
+uint32_t
+UdpMultipathHeader::Deserialize (Buffer::Iterator start)
+{
+  Buffer::Iterator i = start;
+  m_magic = i.ReadU8 ();
+  m_flags = i.ReadU8 ();
+  m_fecGroupSize = i.ReadU8 ();
+  m_fecIndex = i.ReadU8 ();
+  m_fecLength = i.ReadNtohU16 ();
+  m_channelId = i.ReadNtohU32 ();
+  m_channelSeq = i.ReadNtohU32 ();
+  m_flowId = i.ReadNtohU32 ();
+  m_flowSeq = i.ReadNtohU32 ();
+  m_nodeId = i.ReadNtohU32 ();
+  m_hopCount = i.ReadNtohU16 ();
+  return GetSerializedSize ();
+}
+
+/* UdpMultipathReportHeader methods */
+UdpMultipathReportEntry::UdpMultipathReportEntry ()
+{
+  channel_id = 0;
+  delivered_packets = 0;
+  delivered_bytes = 0;
+  lost_packets = 0;
+  probe_seq = 0;
+  probe_sent = 0;
+  probe_hold = 0;
+}
+
+UdpMultipathReportHeader::UdpMultipathReportHeader ()
+{
+}
+
+void
+UdpMultipathReportHeader::AddEntry (const UdpMultipathReportEntry &entry)
+{
+  m_entries.push_back (entry);
+}
+const std::vector<UdpMultipathReportEntry> &
+UdpMultipathReportHeader::GetEntries (void) const
+{
+  return m_entries;
+}
+
+TypeId
+UdpMultipathReportHeader::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::UdpMultipathReportHeader")
+    .SetParent<Header> ()
+    .SetGroupName("Applications")
+    .AddConstructor<UdpMultipathReportHeader> ()
+  ;
+  return tid;
+}
+TypeId
+UdpMultipathReportHeader::GetInstanceTypeId (void) const
+{
+  return GetTypeId ();
+}
+void
+UdpMultipathReportHeader::Print (std::ostream &os) const
+{
+  std::vector<UdpMultipathReportEntry>::const_iterator it;
+  for (it = m_entries.begin (); it != m_entries.end (); ++it)
+    {
+      os << "(channel=" << (*it).channel_id
+         << " packets=" << (*it).delivered_packets
+         << " bytes=" << (*it).delivered_bytes
+         << " lost=" << (*it).lost_packets << ")";
+    }
+}
+uint32_t
+UdpMultipathReportHeader::GetReportSize (uint16_t entries)
+{
+  return 2 + entries * REPORT_ENTRY_SIZE;
+}
+uint32_t
+UdpMultipathReportHeader::GetSerializedSize (void) const
+{
+  return 2 + m_entries.size () * REPORT_ENTRY_SIZE;
+}
+void
+UdpMultipathReportHeader::Serialize (Buffer::Iterator start) const
+{
+  Buffer::Iterator i = start;
+  i.WriteHtonU16 (m_entries.size ());
+  std::vector<UdpMultipathReportEntry>::const_iterator it;
+  for (it = m_entries.begin (); it != m_entries.end (); ++it)
+    {
+      i.WriteHtonU32 ((*it).channel_id);
+      i.WriteHtonU64 ((*it).delivered_packets);
+      i.WriteHtonU64 ((*it).delivered_bytes);
+      i.WriteHtonU64 ((*it).lost_packets);
+      i.WriteHtonU32 ((*it).probe_seq);
+      i.WriteHtonU64 ((*it).probe_sent);
+      i.WriteHtonU64 ((*it).probe_hold);
+    }
+}
+uint32_t
+UdpMultipathReportHeader::Deserialize (Buffer::Iterator start)
+{
+  Buffer::Iterator i = start;
+  uint16_t count = i.ReadNtohU16 ();
+  m_entries.clear ();
+  for (uint16_t n = 0; n < count; n++)
+    {
+      UdpMultipathReportEntry entry;
+      entry.channel_id = i.ReadNtohU32 ();
+      entry.delivered_packets = i.ReadNtohU64 ();
+      entry.delivered_bytes = i.ReadNtohU64 ();
+      entry.lost_packets = i.ReadNtohU64 ();
+      entry.probe_seq = i.ReadNtohU32 ();
+      entry.probe_sent = i.ReadNtohU64 ();
+      entry.probe_hold = i.ReadNtohU64 ();
+      m_entries.push_back (entry);
+    }
+  return GetSerializedSize ();
+}
+
+} // namespace ns3
@@ -0,0 +1,150 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright 2019 - Paolo, Eric
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef UDP_MULTIPATH_HEADER
+#define UDP_MULTIPATH_HEADER
+
+#include "ns3/header.h"
+#include <vector>
+
+namespace ns3 {
+
+/**
+ * \ingroup udpmultipathrouter
+ * \brief Header stamped by UdpMultipathRouter on forwarded packets
+ *
+ * Carries the channel the packet was sent on and a sequence number counted
+ * per next hop (channel and destination), so a UdpMultipathSink can count
+ * deliveries and losses per channel.
+ * The flow id and flow sequence number identify the packet end-to-end, for
+ * duplicate removal and XOR parity (FEC) recovery at the sink. The node id
+ * and hop count form the path tag: routers further down a chain forward
+ * the packet by its final destination instead of its original source.
+ */
+class UdpMultipathHeader : public Header
+{
+public:
+  UdpMultipathHeader ();
+
+  static const uint8_t MAGIC = 0xb7;       //!< first byte of every header, tells it from payload
+  static const uint8_t FLAG_PARITY = 0x01; //!< payload is the XOR of a FEC group
+  static const uint8_t FLAG_PROBE = 0x02;  //!< a SeqTsHeader delay probe follows this header
+
+  bool IsValid (void) const; // false if the bytes read were not a router header
+  void SetFlags (uint8_t flags);
+  uint8_t GetFlags (void) const;
+  bool IsParity (void) const;
+  bool HasProbe (void) const;
+  void SetFecGroupSize (uint8_t size);
+  uint8_t GetFecGroupSize (void) const;
+  void SetFecIndex (uint8_t index);
+  uint8_t GetFecIndex (void) const;
+  void SetFecLength (uint16_t length);
+  uint16_t GetFecLength (void) const;
+  void SetFlowId (uint32_t flow_id);
+  uint32_t GetFlowId (void) const;
+  void SetFlowSeq (uint32_t seq);
+  uint32_t GetFlowSeq (void) const;
+  void SetNodeId (uint32_t node_id);
+  uint32_t GetNodeId (void) const;
+  void SetHopCount (uint16_t hops);
+  uint16_t GetHopCount (void) const;
+  void SetChannelId (uint32_t channel_id);
+  uint32_t GetChannelId (void) const;
+  void SetChannelSeq (uint32_t seq);
+  uint32_t GetChannelSeq (void) const;
+
+  /**
+   * \brief Get the type ID.
+   * \return the object TypeId
+   */
+  static TypeId GetTypeId (void);
+  virtual TypeId GetInstanceTypeId (void) const;
+  virtual void Print (std::ostream &os) const;
+  virtual uint32_t GetSerializedSize (void) const;
+  virtual void Serialize (Buffer::Iterator start) const;
+  virtual uint32_t Deserialize (Buffer::Iterator start);
+
+private:
+  uint8_t m_magic;        //!< MAGIC once built or read from a router header
+  uint8_t m_flags;        //!< FLAG_* bits
+  uint8_t m_fecGroupSize; //!< data packets per parity packet, 0 without FEC
+  uint8_t m_fecIndex;     //!< data packets: position in the FEC group, so the sink finds its first sequence
+  uint16_t m_fecLength;   //!< parity packets: XOR of the group payload lengths
+  uint32_t m_channelId;   //!< channel used by the router
+  uint32_t m_channelSeq;  //!< sequence number within the channel and next hop
+  uint32_t m_flowId;      //!< flow assigned by the first router, its node id in the high 16 bits
+  uint32_t m_flowSeq;     //!< sequence number within the flow (first of the group for parity)
+  uint32_t m_nodeId;      //!< final destination node id
+  uint16_t m_hopCount;    //!< routers crossed so far, 0 for an untagged packet
+};
+
+/**
+ * Per-channel delivery counters, cumulative since the sink started, and
+ * the last delay probe received on the channel: the sink does not echo
+ * packets, so the probe timestamp comes back to the router in the report.
+ */
+class UdpMultipathReportEntry
+{
+public:
+  UdpMultipathReportEntry ();
+  uint32_t channel_id;
+  uint64_t delivered_packets;
+  uint64_t delivered_bytes;
+  uint64_t lost_packets;
+  uint32_t probe_seq;
+  uint64_t probe_sent; // time step the router stamped, 0 if no probe since the last report
+  uint64_t probe_hold; // nanoseconds the sink kept the probe before reporting it
+};
+
+/**
+ * \ingroup udpmultipathrouter
+ * \brief Receiver report sent by UdpMultipathSink back to the router
+ */
+class UdpMultipathReportHeader : public Header
+{
+public:
+  UdpMultipathReportHeader ();
+
+  void AddEntry (const UdpMultipathReportEntry &entry);
+  const std::vector<UdpMultipathReportEntry> & GetEntries (void) const;
+  /**
+   * \brief Serialized size of a report, for checking received datagrams
+   * \param entries the entry count, the first two bytes of a report
+   * \return the size in bytes
+   */
+  static uint32_t GetReportSize (uint16_t entries);
+
+  /**
+   * \brief Get the type ID.
+   * \return the object TypeId
+   */
+  static TypeId GetTypeId (void);
+  virtual TypeId GetInstanceTypeId (void) const;
+  virtual void Print (std::ostream &os) const;
+  virtual uint32_t GetSerializedSize (void) const;
+  virtual void Serialize (Buffer::Iterator start) const;
+  virtual uint32_t Deserialize (Buffer::Iterator start);
+
+private:
+  std::vector<UdpMultipathReportEntry> m_entries; //!< one entry per channel
+};
+
+} // namespace ns3
+
+#endif /* UDP_MULTIPATH_HEADER */
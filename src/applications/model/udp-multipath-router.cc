@@ -29,14 +29,71 @@
 #include "ns3/socket-factory.h"
 #include "ns3/packet.h"
 #include "ns3/uinteger.h"
+#include "ns3/enum.h"
+#include "ns3/string.h"
+#include "ns3/random-variable-stream.h"
+#include "ns3/seq-ts-header.h"
 
 #include "udp-multipath-router.h"
+#include "udp-multipath-header.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
 
 #define NODE_ERROR 16666
-#define CHANNEL_TABLE_REFRESH_RATE 0.1
+#define CHANNEL_TABLE_REFRESH_RATE 0.1 // seconds, default of the RefreshInterval attribute
+#define DEFAULT_EWMA_ALPHA 0.25
+#define DEFAULT_RATE_WINDOW 10
+#define DEFAULT_HISTORY_SIZE 128 // refresh intervals, 12.8 s
+#define DEFAULT_AFFINITY_THRESHOLD 0.9
+// AQM parameters (RED as in RFC 2309 / ns-3 RedQueueDisc, CoDel RFC 8289, PIE RFC 8033)
+#define RED_QUEUE_WEIGHT 0.002
+#define RED_MAX_PROBABILITY 0.02
+#define CODEL_TARGET MilliSeconds (5)
+#define CODEL_INTERVAL MilliSeconds (100)
+#define CODEL_MTU 1500
+#define PIE_TARGET 0.015 // seconds
+#define PIE_UPDATE_PERIOD MilliSeconds (15)
+#define PIE_ALPHA 0.125
+#define PIE_BETA 1.25
+#define DELAY_GAIN 0.125 // like TCP SRTT
+#define REFERENCE_PACKET_BITS (1500 * 8)
+#define LOSS_GAIN 0.25
+// Reported loss above which a channel is taken as saturated: what the receiver
+// gets (the delivery rate) is then the most the path carries
+#define SATURATION_LOSS 0.01
+// Probes still matched against their echoes; older ones are forgotten
+#define PROBE_WINDOW 1024
+// Tagged packets are dropped after this many routers, in case of a routing loop
+#define MAX_HOP_COUNT 16
+// FLOW_AFFINITY remembers at most this many flows moved off their natural channel
+#define MAX_FLOW_ASSIGNMENTS 4096
+// Packets HandleRead takes from one socket before yielding to other events
+#define DEFAULT_RECEIVE_BUDGET 64
+
+// Per-packet logging of the forwarding path (HandleRead, RoutePacket, queues, Send).
+// Even with NS_LOG enabled it is compiled out unless the module is built with
+// -DUDP_MULTIPATH_HOT_PATH_LOG=1, so debug builds skip the formatting as well;
+// the Route trace source gives the same information without it.
+#ifndef UDP_MULTIPATH_HOT_PATH_LOG
+#define UDP_MULTIPATH_HOT_PATH_LOG 0
+#endif
+#define HOT_PATH_LOGIC(msg)                        \
+  do                                               \
+    {                                              \
+      if (ns3::HOT_PATH_LOG)                       \
+        {                                          \
+          NS_LOG_LOGIC (msg);                      \
+        }                                          \
+    }                                              \
+  while (false)
 
 namespace ns3 {
 
+static constexpr bool HOT_PATH_LOG = UDP_MULTIPATH_HOT_PATH_LOG;
+
 NS_LOG_COMPONENT_DEFINE ("UdpMultipathRouterApplication");
 
 NS_OBJECT_ENSURE_REGISTERED (UdpMultipathRouter);
@@ -45,136 +102,557 @@ NS_OBJECT_ENSURE_REGISTERED (UdpMultipathRouter);
 ChannelTableEntry::ChannelTableEntry ( uint32_t id, uint32_t capacity )
 {
   channel_id = id;
-  channel_capacity = capacity;
-  current_use = 0;
+  channel_capacity = static_cast<uint64_t> (capacity) * 1000000;
   last_measure = Simulator::Now();
-  byte_counter = 0;
-  dropped_packets = 0;
   byte_counter_sum = 0;
+  packet_counter_sum = 0;
   dropped_packets_sum = 0;
-  // data rate in mbps * 1024 = data rate in kbps
-  // kbps / 8 = KB/s
+  dropped_bytes_sum = 0;
+  removed = false;
+  // bits/s / 8 = bytes/s
   // multiplied by second fraction
-  // yields max kilobits per refresh_rate, the desired drop threshold
-  drop_threshold =  (capacity * 1024 / 8) * CHANNEL_TABLE_REFRESH_RATE;
+  // yields max bytes per refresh_rate, the desired drop threshold
+  drop_threshold = (channel_capacity / 8) * CHANNEL_TABLE_REFRESH_RATE;
 }
 ChannelTable::ChannelTable()
 {
+  rateEstimator = RateEstimator::LAST_INTERVAL;
+  ewma_alpha = DEFAULT_EWMA_ALPHA;
+  refresh_interval = CHANNEL_TABLE_REFRESH_RATE;
+  rate_window = DEFAULT_RATE_WINDOW;
+  window_position = 0;
+  shaper_burst = 0;
+  stats_writer = 0;
+  refresh_started = false;
+  history_size = DEFAULT_HISTORY_SIZE;
+  history_position = 0;
 }
 void
 ChannelTable::AddChannelEntry ( uint32_t id, uint32_t capacity )  {
+  NS_ASSERT_MSG (channel_index.find (id) == channel_index.end (), "Channel " << id << " already exists");
+  NS_ASSERT_MSG (id != NO_CHANNEL_ID, "Channel id " << id << " is reserved");
+  // rates, token refills and queue pacing all divide by the capacity
+  NS_ASSERT_MSG (capacity > 0, "Channel " << id << " needs a capacity above 0 Mbps");
+  channel_index[id] = entries.size ();
   entries.push_back( ChannelTableEntry ( id, capacity ) );
+  entries.back ().drop_threshold = (entries.back ().channel_capacity / 8) * refresh_interval;
+  byte_counter.push_back( 0 );
+  packet_counter.push_back( 0 );
+  dropped_packets.push_back( 0 );
+  dropped_bytes.push_back( 0 );
+  current_use.push_back( 0 );
+  channel_delay.push_back( 0 );
+  reported_packets.push_back( 0 );
+  reported_bytes.push_back( 0 );
+  reported_lost.push_back( 0 );
+  last_report.push_back( Simulator::Now () );
+  loss_ratio.push_back( 0 );
+  delivery_rate.push_back( 0 );
+  window_samples.resize( entries.size () * rate_window, 0 );
+  window_sum.push_back( 0 );
+  window_fill.push_back( 0 );
+  shaper_tokens.push_back( GetShaperBurstAt( entries.size () - 1 ) );
+  shaper_last_refill.push_back( Simulator::Now () );
+  history_fill.push_back( 0 );
+  history_utilisation.resize( entries.size () * history_size, 0 );
+  history_drop_rate.resize( entries.size () * history_size, 0 );
+  p95_use.push_back( 0 );
 }
 
-// TODO: Maybe use mutex here
 void
-ChannelTable::UpdateChannelByteCounter( uint32_t id, uint32_t routed_bytes ) {
-  NS_LOG_LOGIC(" Updating byte counter " );
-  std::list<ChannelTableEntry>::iterator it;
-  for (it = entries.begin(); it != entries.end(); ++it) {
-    if ( (*it).channel_id == id ) {
-      NS_LOG_LOGIC( " Found channel id " << id );
-      (*it).byte_counter += routed_bytes;
-      return;
+ChannelTable::RemoveChannelEntry ( uint32_t id ) {
+  uint32_t index = GetChannelIndex( id );
+  NS_ASSERT_MSG (index != INVALID_INDEX, "Channel " << id << " does not exist");
+  channel_index.erase (id);
+  entries[index].removed = true;
+  current_use[index] = 0;
+}
+
+// Token buckets keep their level, capped at the new depth
+void
+ChannelTable::SetChannelCapacity ( uint32_t id, uint32_t capacity ) {
+  uint32_t index = GetChannelIndex( id );
+  NS_ASSERT_MSG (index != INVALID_INDEX, "Channel " << id << " does not exist");
+  NS_ASSERT_MSG (capacity > 0, "Channel " << id << " needs a capacity above 0 Mbps, remove it instead");
+  UpdateChannelsCurrentUse( ); // intervals that ended so far count at the old capacity
+  ChannelTableEntry &entry = entries[index];
+  entry.channel_capacity = static_cast<uint64_t> (capacity) * 1000000;
+  entry.drop_threshold = (entry.channel_capacity / 8) * refresh_interval;
+  RefillTokensAt( index );
+  shaper_tokens[index] = std::min (shaper_tokens[index], static_cast<double> (GetShaperBurstAt( index )));
+}
+
+void
+ChannelTable::SetRateEstimator( RateEstimator estimator ) {
+  rateEstimator = estimator;
+  ResetRateEstimator ();
+}
+
+void
+ChannelTable::SetEwmaAlpha( double alpha ) {
+  NS_ASSERT_MSG (alpha > 0 && alpha <= 1, "EWMA alpha must be in (0, 1]");
+  ewma_alpha = alpha;
+}
+
+void
+ChannelTable::SetRateWindow( uint32_t intervals ) {
+  NS_ASSERT_MSG (intervals > 0, "Rate window must hold at least one interval");
+  rate_window = intervals;
+  ResetRateEstimator ();
+}
+
+// Drop thresholds and estimator windows are in intervals, so they follow
+void
+ChannelTable::SetRefreshInterval( Time interval ) {
+  NS_ASSERT_MSG (interval.IsStrictlyPositive (), "Refresh interval must be positive");
+  refresh_interval = interval.GetSeconds ();
+  for (uint32_t i = 0; i < entries.size (); i++) {
+    entries[i].drop_threshold = (entries[i].channel_capacity / 8) * refresh_interval;
+  }
+  ResetRateEstimator ();
+}
+
+Time
+ChannelTable::GetRefreshInterval( ) const {
+  return Seconds ( refresh_interval );
+}
+
+void
+ChannelTable::SetHistorySize( uint32_t intervals ) {
+  NS_ASSERT_MSG (intervals > 0, "History must hold at least one interval");
+  history_size = intervals;
+  history_position = 0;
+  std::fill (history_fill.begin (), history_fill.end (), 0);
+  history_utilisation.assign( entries.size () * history_size, 0 );
+  history_drop_rate.assign( entries.size () * history_size, 0 );
+  std::fill (p95_use.begin (), p95_use.end (), 0);
+}
+
+// Called with the counters of the interval just closed. The samples are the
+// raw interval rates, not the estimator output, so percentiles keep the bursts
+void
+ChannelTable::RecordHistory( const std::vector<uint64_t> &samples ) {
+  for (uint32_t i = 0; i < entries.size (); i++) {
+    uint32_t slot = i * history_size + history_position;
+    history_utilisation[slot] = entries[i].channel_capacity > 0
+      ? static_cast<float> (samples[i]) / entries[i].channel_capacity : 0;
+    uint64_t offered = packet_counter[i] + dropped_packets[i];
+    history_drop_rate[slot] = offered > 0 ? static_cast<float> (dropped_packets[i]) / offered : 0;
+    if (history_fill[i] < history_size) {
+      history_fill[i]++;
+    }
+  }
+  history_position = (history_position + 1) % history_size;
+}
+
+void
+ChannelTable::UpdatePercentiles( ) {
+  for (uint32_t i = 0; i < entries.size (); i++) {
+    p95_use[i] = static_cast<uint64_t> (HistoryPercentileAt( history_utilisation, i, 0.95 )
+                                        * entries[i].channel_capacity);
+  }
+}
+
+// Nearest rank percentile over the samples held for channel index
+double
+ChannelTable::HistoryPercentileAt( const std::vector<float> &samples, uint32_t index, double percentile ) const {
+  NS_ASSERT_MSG (percentile >= 0 && percentile <= 1, "Percentile must be in [0, 1]");
+  uint32_t fill = history_fill[index];
+  if (fill == 0) {
+    return 0;
+  }
+  // the samples are the fill slots before history_position, wrapping around
+  std::vector<float> sorted (fill);
+  uint32_t slot = history_position;
+  for (uint32_t i = 0; i < fill; i++) {
+    slot = (slot == 0 ? history_size : slot) - 1;
+    sorted[i] = samples[index * history_size + slot];
+  }
+  uint32_t rank = static_cast<uint32_t> (std::ceil (percentile * fill));
+  std::vector<float>::iterator nth = sorted.begin () + (rank > 0 ? rank - 1 : 0);
+  std::nth_element (sorted.begin (), nth, sorted.end ());
+  return *nth;
+}
+
+double
+ChannelTable::GetUtilisationPercentile( uint32_t channel_id, double percentile ) const {
+  uint32_t index = GetChannelIndex( channel_id );
+  return index != INVALID_INDEX ? GetUtilisationPercentileAt( index, percentile ) : 0;
+}
+
+double
+ChannelTable::GetUtilisationPercentileAt( uint32_t index, double percentile ) const {
+  return HistoryPercentileAt( history_utilisation, index, percentile );
+}
+
+double
+ChannelTable::GetDropRatePercentile( uint32_t channel_id, double percentile ) const {
+  uint32_t index = GetChannelIndex( channel_id );
+  return index != INVALID_INDEX ? GetDropRatePercentileAt( index, percentile ) : 0;
+}
+
+double
+ChannelTable::GetDropRatePercentileAt( uint32_t index, double percentile ) const {
+  return HistoryPercentileAt( history_drop_rate, index, percentile );
+}
+
+uint64_t
+ChannelTable::GetChannelP95UseAt( uint32_t index ) const {
+  return p95_use[index];
+}
+
+void
+ChannelTable::ResetRateEstimator( ) {
+  window_position = 0;
+  window_samples.assign( entries.size () * rate_window, 0 );
+  std::fill (window_sum.begin (), window_sum.end (), 0);
+  std::fill (window_fill.begin (), window_fill.end (), 0);
+}
+
+// rtt comes from echoed probe headers; half of it is taken as one-way delay
+void
+ChannelTable::UpdateChannelDelayAt( uint32_t index, Time rtt ) {
+  double sample = rtt.GetSeconds () / 2;
+  channel_delay[index] = channel_delay[index] == 0 ? sample
+    : (1 - DELAY_GAIN) * channel_delay[index] + DELAY_GAIN * sample;
+}
+
+double
+ChannelTable::GetChannelDelayAt( uint32_t index ) const {
+  return channel_delay[index];
+}
+
+void
+ChannelTable::UpdateDeliveryAt( uint32_t index, uint64_t delivered_packets, uint64_t delivered_bytes,
+                                uint64_t lost_packets ) {
+  if (delivered_packets < reported_packets[index]) {
+    // receiver restarted, start over from its counters
+    reported_packets[index] = 0;
+    reported_bytes[index] = 0;
+    reported_lost[index] = 0;
+  }
+  Time now = Simulator::Now ();
+  double interval = (now - last_report[index]).GetSeconds ();
+  uint64_t packets = delivered_packets - reported_packets[index];
+  uint64_t bytes = delivered_bytes - reported_bytes[index];
+  uint64_t lost = lost_packets > reported_lost[index] ? lost_packets - reported_lost[index] : 0;
+  if (interval > 0) {
+    delivery_rate[index] = static_cast<uint64_t> (bytes * 8 / interval);
+  }
+  if (packets + lost > 0) {
+    double sample = static_cast<double> (lost) / (packets + lost);
+    loss_ratio[index] = (1 - LOSS_GAIN) * loss_ratio[index] + LOSS_GAIN * sample;
+  }
+  reported_packets[index] = delivered_packets;
+  reported_bytes[index] = delivered_bytes;
+  reported_lost[index] = lost_packets;
+  last_report[index] = now;
+}
+
+double
+ChannelTable::GetChannelLossRatioAt( uint32_t index ) const {
+  return loss_ratio[index];
+}
+
+uint64_t
+ChannelTable::GetChannelDeliveryRateAt( uint32_t index ) const {
+  return delivery_rate[index];
+}
+
+void
+ChannelTable::SetShaperBurst( uint32_t bytes ) {
+  shaper_burst = bytes;
+  for (uint32_t i = 0; i < entries.size (); i++) {
+    shaper_tokens[i] = std::min (shaper_tokens[i], static_cast<double> (GetShaperBurstAt( i )));
+  }
+}
+
+uint64_t
+ChannelTable::GetShaperBurstAt( uint32_t index ) const {
+  return shaper_burst > 0 ? shaper_burst : entries[index].drop_threshold;
+}
+
+void
+ChannelTable::RefillTokensAt( uint32_t index ) {
+  Time now = Simulator::Now ();
+  double elapsed = (now - shaper_last_refill[index]).GetSeconds ();
+  shaper_last_refill[index] = now;
+  shaper_tokens[index] = std::min (shaper_tokens[index] + elapsed * entries[index].channel_capacity / 8.0,
+                                   static_cast<double> (GetShaperBurstAt( index )));
+}
+
+// Policer: the packet passes only if the bucket holds enough tokens
+bool
+ChannelTable::ConsumeTokensAt( uint32_t index, uint32_t bytes ) {
+  RefillTokensAt( index );
+  if (shaper_tokens[index] < bytes) {
+    return false;
+  }
+  shaper_tokens[index] -= bytes;
+  return true;
+}
+
+// Shaper: the bucket may go into debt by up to one burst; delay is the time
+// until the debt is paid back at channel capacity
+bool
+ChannelTable::ReserveTokensAt( uint32_t index, uint32_t bytes, Time &delay ) {
+  RefillTokensAt( index );
+  double tokens = shaper_tokens[index] - bytes;
+  if (tokens < -static_cast<double> (GetShaperBurstAt( index ))) {
+    return false;
+  }
+  shaper_tokens[index] = tokens;
+  delay = tokens < 0 ? Seconds (-tokens * 8.0 / entries[index].channel_capacity) : Seconds (0);
+  return true;
+}
+
+void
+ChannelTable::SetRateCallback( Callback<void, uint32_t, Time, uint64_t, uint64_t> callback ) {
+  rate_callback = callback;
+}
+
+void
+ChannelTable::SetStatsWriter( ChannelStatsWriter *writer ) {
+  stats_writer = writer;
+}
+
+uint64_t
+ChannelTable::EstimateCurrentUse( uint32_t index, uint64_t sample ) {
+  switch (rateEstimator) {
+    case RateEstimator::LAST_INTERVAL: {
+      return sample;
+    }
+    case RateEstimator::EWMA: {
+      return static_cast<uint64_t> (ewma_alpha * sample + (1 - ewma_alpha) * current_use[index]);
+    }
+    case RateEstimator::SLIDING_WINDOW: {
+      uint64_t &slot = window_samples[index * rate_window + window_position];
+      window_sum[index] = window_sum[index] - slot + sample;
+      slot = sample;
+      if (window_fill[index] < rate_window) {
+        window_fill[index]++;
+      }
+      return window_sum[index] / window_fill[index];
     }
+    default:
+      NS_ASSERT_MSG (false, "Invalid rate estimator");
   }
-  NS_LOG_LOGIC( " Did not find channel id " << id );
+  return sample;
+}
+
+uint32_t
+ChannelTable::GetChannelIndex( uint32_t channel_id ) const {
+  std::unordered_map<uint32_t, uint32_t>::const_iterator it = channel_index.find (channel_id);
+  return it != channel_index.end () ? it->second : INVALID_INDEX;
+}
+
+uint32_t
+ChannelTable::GetChannelId( uint32_t index ) const {
+  return entries[index].channel_id;
+}
+
+uint32_t
+ChannelTable::GetChannelCount( ) const {
+  return entries.size ();
+}
+
+void
+ChannelTable::UpdateChannelByteCounterAt( uint32_t index, uint32_t routed_bytes ) {
+  byte_counter[index] += routed_bytes;
+  packet_counter[index] += 1;
 }
 
+// Rates are derived on demand instead of by a periodic event: the router
+// calls this once per HandleRead batch, drain or delayed send event, before
+// reading the rates or counting, and every refresh interval that ended since
+// the last call is closed then, at its own end time. An idle router
+// schedules nothing.
 void
 ChannelTable::UpdateChannelsCurrentUse( ) {
-  Time current_time = Simulator::Now();
-  std::list<ChannelTableEntry>::iterator it;
-  std::list<ChannelTableEntry>::iterator log_it;
-  for (it = entries.begin(); it != entries.end(); ++it) {
-    // Do time diff
-    double time_diff = current_time.GetSeconds() -  (*it).last_measure.GetSeconds();
-    // Compute use in last time interval
-    // Converts kilobyte counter to kilobits and then to megabits
-    // uint64_t use_in_last_interval = (((*it).byte_counter * 8) / 1024) / time_diff;
-    // Average last measure with current measure
-    // (*it).current_use = ( (*it).current_use + use_in_last_interval ) / 2;
-    (*it).current_use = (((*it).byte_counter * 8) / 1024) / time_diff;
-    // update last_measure
-    (*it).last_measure = current_time;
-    // schedule new update
+  if (!refresh_started) {
+    return;
   }
-  LogChannelTable ();
-  for (it = entries.begin(); it != entries.end(); ++it) {
-    (*it).byte_counter_sum += (*it).byte_counter;
-    (*it).dropped_packets_sum += (*it).dropped_packets;
-    // reset byte_counter
-    (*it).byte_counter = 0;
-    (*it).dropped_packets = 0;
+  Time now = Simulator::Now();
+  Time period = Seconds ( refresh_interval );
+  uint32_t closed = 0;
+  while (now >= next_refresh && closed <= rate_window) {
+    CloseInterval( next_refresh );
+    next_refresh += period;
+    closed++;
+  }
+  if (now >= next_refresh) {
+    // Long idle gap: the estimators have already seen enough empty intervals
+    // to settle at zero use, except the EWMA which keeps decaying
+    int64_t skipped = (now - next_refresh).GetNanoSeconds () / period.GetNanoSeconds () + 1;
+    // The skipped intervals are still empty samples: the history gets zeros
+    // (at most a full ring of them). The stats file only gets the first and
+    // last of them, so a long gap costs two records per channel, not one per interval
+    std::vector<uint64_t> idle (entries.size (), 0);
+    for (int64_t k = 0; k < std::min (skipped, static_cast<int64_t> (history_size)); k++) {
+      RecordHistory( idle );
+    }
+    UpdatePercentiles( );
+    if (stats_writer != 0) {
+      ChannelStatsRecord record;
+      for (int64_t k = 0; k < skipped; k = (k == 0 && skipped > 2) ? skipped - 1 : k + 1) {
+        record.time_ns = (next_refresh + period * k).GetNanoSeconds ();
+        double decay = rateEstimator == RateEstimator::EWMA
+          ? std::pow (1 - ewma_alpha, static_cast<double> (k + 1)) : 1;
+        for (uint32_t i = 0; i < entries.size (); i++) {
+          if (entries[i].removed) {
+            continue;
+          }
+          record.channel_id = entries[i].channel_id;
+          record.capacity = entries[i].channel_capacity;
+          record.current_use = static_cast<uint64_t> (current_use[i] * decay);
+          record.bytes = 0;
+          record.packets = 0;
+          record.dropped_packets = 0;
+          record.dropped_bytes = 0;
+          stats_writer->Write( record );
+        }
+      }
+    }
+    if (rateEstimator == RateEstimator::EWMA) {
+      double decay = std::pow (1 - ewma_alpha, static_cast<double> (skipped));
+      Time last_end = next_refresh + period * (skipped - 1);
+      for (uint32_t i = 0; i < entries.size (); i++) {
+        uint64_t old_use = current_use[i];
+        current_use[i] = static_cast<uint64_t> (current_use[i] * decay);
+        if (!rate_callback.IsNull () && old_use != current_use[i]) {
+          rate_callback( entries[i].channel_id, last_end, old_use, current_use[i] );
+        }
+      }
+    }
+    next_refresh += period * skipped;
+    for (uint32_t i = 0; i < entries.size (); i++) {
+      entries[i].last_measure = next_refresh - period;
+    }
   }
-  ChannelTable::ScheduleChannelTableUpdate( Seconds ( CHANNEL_TABLE_REFRESH_RATE ) );
 }
 
-void 
-ChannelTable::ScheduleChannelLog( ) {
-//  LogChannelTable ();
-  Simulator::Schedule ( Seconds ( 1.0 ), &ChannelTable::ScheduleChannelLog, this );
+// Folds the counters of the interval ending at current_time into the rate
+// estimates, then starts a new interval
+void
+ChannelTable::CloseInterval( Time current_time ) {
+  std::vector<uint64_t> samples (entries.size ());
+  for (uint32_t i = 0; i < entries.size (); i++) {
+    // Do time diff
+    double time_diff = current_time.GetSeconds() -  entries[i].last_measure.GetSeconds();
+    // Compute use in last time interval, in bits/s, and fold it into the estimate
+    uint64_t sample = time_diff > 0 ? static_cast<uint64_t> ((byte_counter[i] * 8) / time_diff) : 0;
+    samples[i] = sample;
+    uint64_t old_use = current_use[i];
+    current_use[i] = EstimateCurrentUse( i, sample );
+    if (!rate_callback.IsNull () && old_use != current_use[i]) {
+      rate_callback( entries[i].channel_id, current_time, old_use, current_use[i] );
+    }
+    // update last_measure
+    entries[i].last_measure = current_time;
+  }
+  window_position = (window_position + 1) % rate_window;
+  RecordHistory (samples);
+  UpdatePercentiles ();
+  LogChannelTable (current_time);
+  if (stats_writer != 0) {
+    ChannelStatsRecord record;
+    record.time_ns = current_time.GetNanoSeconds ();
+    for (uint32_t i = 0; i < entries.size (); i++) {
+      if (entries[i].removed) {
+        continue;
+      }
+      record.channel_id = entries[i].channel_id;
+      record.capacity = entries[i].channel_capacity;
+      record.current_use = current_use[i];
+      record.bytes = byte_counter[i];
+      record.packets = packet_counter[i];
+      record.dropped_packets = dropped_packets[i];
+      record.dropped_bytes = dropped_bytes[i];
+      stats_writer->Write( record );
+    }
+  }
+  for (uint32_t i = 0; i < entries.size (); i++) {
+    entries[i].byte_counter_sum += byte_counter[i];
+    entries[i].packet_counter_sum += packet_counter[i];
+    entries[i].dropped_packets_sum += dropped_packets[i];
+    entries[i].dropped_bytes_sum += dropped_bytes[i];
+  }
+  // reset counters
+  std::fill (byte_counter.begin (), byte_counter.end (), 0);
+  std::fill (packet_counter.begin (), packet_counter.end (), 0);
+  std::fill (dropped_packets.begin (), dropped_packets.end (), 0);
+  std::fill (dropped_bytes.begin (), dropped_bytes.end (), 0);
 }
 
 void
-ChannelTable::LogChannelTable( ) {
-  std::list<ChannelTableEntry>::iterator it;
+ChannelTable::LogChannelTable( Time interval_end ) {
+    // stamped with the end of the interval, which may be earlier than now
     NS_LOG_INFO( "===========================================" );
-    NS_LOG_INFO( "ChannelTable at time: " << Simulator::Now() );
+    NS_LOG_INFO( "ChannelTable at time: " << interval_end );
     NS_LOG_INFO( 
-  "| id | \tcapacity| \tuse | \tlast_measure |" "\t kilobyte_counter | \t packet_loss | "
-  << "\t total_kilobyte_count | \t total_dropped_packets | drop_threshold"
+  "| id | \tcapacity (bps) | \tuse (bps) | \tlast_measure |" "\t byte_counter | \t packet_counter | \t packet_loss | "
+  << "\t total_byte_count | \t total_dropped_packets | drop_threshold"
                 );
-  for (it = entries.begin(); it != entries.end(); ++it) {
+  for (uint32_t i = 0; i < entries.size (); i++) {
+    if (entries[i].removed) {
+      continue;
+    }
     NS_LOG_INFO(
-                 "|#ID:" << (*it).channel_id << "|\t" << (*it).channel_capacity  << "\t|\t"
-                      << (*it).current_use << "|" << (*it).last_measure << "|\t" << (*it).byte_counter
-                      << "\t" << (*it).dropped_packets << "\t" << (*it).byte_counter_sum
-                      << "\t" << (*it).dropped_packets_sum << "|"
-                      << "\t" << (*it).drop_threshold << "|"
+                 "|#ID:" << entries[i].channel_id << "|\t" << entries[i].channel_capacity  << "\t|\t"
+                      << current_use[i] << "|" << entries[i].last_measure << "|\t" << byte_counter[i]
+                      << "\t" << packet_counter[i] << "\t" << dropped_packets[i]
+                      << "\t" << entries[i].byte_counter_sum
+                      << "\t" << entries[i].dropped_packets_sum << "|"
+                      << "\t" << entries[i].drop_threshold << "|"
                 );
   }
 }
 
+// Starts rate measurement: the first interval ends dt from now, the next
+// ones every refresh interval after it
 void
 ChannelTable::ScheduleChannelTableUpdate ( Time dt ) {
-  Simulator::Schedule ( dt, &ChannelTable::UpdateChannelsCurrentUse, this );
+  refresh_started = true;
+  next_refresh = Simulator::Now () + dt;
 }
 
-uint32_t
-ChannelTable::GetChannelAvailableCapacity(uint32_t channel_id)
+uint64_t
+ChannelTable::GetChannelCapacityAt(uint32_t index) const
 {
-  std::list<ChannelTableEntry>::iterator it;
-  for (it = entries.begin(); it != entries.end(); ++it) {
-    if ((*it).channel_id == channel_id) {
-      return (*it).channel_capacity > (*it).current_use ? ( (*it).channel_capacity - (*it).current_use ) : 0;
-    }
-  }
-  return 0;
+  return entries[index].channel_capacity;
 }
 
-uint32_t
-ChannelTable::GetAvailableBytes(uint32_t channel_id)
+uint64_t
+ChannelTable::GetChannelAvailableCapacity(uint32_t channel_id) const
 {
-  std::list<ChannelTableEntry>::iterator it;
-  for (it = entries.begin(); it != entries.end(); ++it) {
-    if ((*it).channel_id == channel_id) {
-      return (*it).drop_threshold > (*it).byte_counter ? ( (*it).drop_threshold- (*it).byte_counter) : 0;
-    }
-  }
-  return 0;
+  uint32_t index = GetChannelIndex( channel_id );
+  return index != INVALID_INDEX ? GetChannelAvailableCapacityAt( index ) : 0;
+}
+
+uint64_t
+ChannelTable::GetChannelAvailableCapacityAt(uint32_t index) const
+{
+  return entries[index].channel_capacity > current_use[index] ? ( entries[index].channel_capacity - current_use[index] ) : 0;
+}
+
+uint64_t
+ChannelTable::GetAvailableBytes(uint32_t channel_id) const
+{
+  uint32_t index = GetChannelIndex( channel_id );
+  return index != INVALID_INDEX ? GetAvailableBytesAt( index ) : 0;
+}
+
+uint64_t
+ChannelTable::GetAvailableBytesAt(uint32_t index) const
+{
+  return entries[index].drop_threshold > byte_counter[index] ? ( entries[index].drop_threshold - byte_counter[index] ) : 0;
 }
 
 void
-ChannelTable::AddDroppedPacket(uint32_t channel_id)
+ChannelTable::AddDroppedPacketAt(uint32_t index, uint32_t bytes)
 {
-  std::list<ChannelTableEntry>::iterator it;
-  for (it = entries.begin(); it != entries.end(); ++it) {
-    if ((*it).channel_id == channel_id) {
-      (*it).dropped_packets+= 1;
-      return;
-    }
-  }
+  dropped_packets[index] += 1;
+  dropped_bytes[index] += bytes;
 }
 
 /* NodeTable methods */
@@ -187,38 +665,51 @@ NodeTableEntry::NodeTableEntry(uint32_t node, Address addr,
   dest_port = port;
   dest_socket = socket;
   channel_id = channel;
+  channel_index = ChannelTable::INVALID_INDEX;
+  wrr_current_weight = 0;
+  tx_sequence = 0;
 }
 NodeTable::NodeTable()
 {
+  affinity_threshold = DEFAULT_AFFINITY_THRESHOLD;
 }
-uint32_t
-NodeTable::FindSocketChannel( Ptr<Socket> socket )
+void
+NodeTable::AddNodeEntry ( uint32_t node, Address addr, uint16_t port, Ptr<Socket> socket, uint32_t channel)
+{
+  entries.push_back( NodeTableEntry ( node, addr, port, socket, channel ) );
+}
+NodeTableEntry *
+NodeTable::FindNodeEntry ( Address addr, uint16_t port, uint32_t node, uint32_t channel_id )
 {
   std::list<NodeTableEntry>::iterator it;
   for (it = entries.begin(); it != entries.end(); ++it) {
-    if ((*it).dest_socket == socket) {
-      return (*it).channel_id;
+    if ((*it).node_id == node && (*it).channel_id == channel_id && (*it).dest_port == port
+        && (*it).dest_addr == addr) {
+      return &(*it);
     }
   }
-  return NODE_ERROR;
+  return 0;
 }
 void
-NodeTable::AddNodeEntry ( uint32_t node, Address addr, uint16_t port, Ptr<Socket> socket, uint32_t channel)
-{
-  entries.push_back( NodeTableEntry ( node, addr, port, socket, channel ) );
-}
-std::list<NodeTableEntry>
-NodeTable::GetAvailableChannels ( uint32_t id )
+NodeTable::RetireNodeEntry ( NodeTableEntry *entry )
 {
-  std::list<NodeTableEntry> availableEntries;
   std::list<NodeTableEntry>::iterator it;
   for (it = entries.begin(); it != entries.end(); ++it) {
-    if ( (*it).node_id == id ) {
-      availableEntries.push_back( ( *it ) );
-      NS_LOG_LOGIC( "Found available channel id " << id << " for node " << id);
+    if (&(*it) == entry) {
+      break;
+    }
+  }
+  NS_ASSERT_MSG (it != entries.end (), "Retiring an unknown node entry");
+  // splice moves the list node itself, entry keeps its address
+  retired.splice (retired.end (), entries, it);
+  std::unordered_map<uint64_t, NodeTableEntry *>::iterator assigned = flow_assignments.begin ();
+  while (assigned != flow_assignments.end ()) {
+    if (assigned->second == entry) {
+      assigned = flow_assignments.erase (assigned);
+    } else {
+      ++assigned;
     }
   }
-  return availableEntries;
 }
 void
 NodeTable::LogNodeTable( ) {
@@ -237,21 +728,23 @@ NodeTable::LogNodeTable( ) {
   }
   NS_LOG_INFO( "===========================================" );
 }
-NodeTableEntry
-NodeTable::ChooseBestPath ( std::list<NodeTableEntry> available_pathes, BalancingAlgorithm algorithm, ChannelTable channelTable) {
-  std::list<NodeTableEntry>::iterator it;
-  it = available_pathes.begin();
+NodeTableEntry *
+NodeTable::ChooseBestPath ( const std::vector<NodeTableEntry *> &candidates, BalancingAlgorithm algorithm,
+                            const ChannelTable &channelTable, uint64_t flow_hash ) {
+  NS_ASSERT_MSG (!candidates.empty (), " No candidate channels to choose from ");
+  std::vector<NodeTableEntry *>::const_iterator it;
+  it = candidates.begin();
   switch (algorithm) {
     case BalancingAlgorithm::NO_BALANCING: {
       return (*it);
     }
     case BalancingAlgorithm::TX_RATE: {
-      uint32_t best_capacity = 0;
-      NodeTableEntry bestPath= (*it);
-      for (it = available_pathes.begin(); it != available_pathes.end(); ++it) {
-        uint32_t channel_capacity = channelTable.GetChannelAvailableCapacity( (*it).channel_id );
+      uint64_t best_capacity = 0;
+      NodeTableEntry *bestPath = (*it);
+      for (it = candidates.begin(); it != candidates.end(); ++it) {
+        uint64_t channel_capacity = channelTable.GetChannelAvailableCapacityAt( (*it)->channel_index );
         if ( channel_capacity > best_capacity ) {
-          NS_LOG_LOGIC( " Best capacity " << channel_capacity << " channel id: " << (*it).channel_id);
+          HOT_PATH_LOGIC( " Best capacity " << channel_capacity << " channel id: " << (*it)->channel_id);
           bestPath = (*it);
           best_capacity = channel_capacity;
         }
@@ -259,12 +752,12 @@ NodeTable::ChooseBestPath ( std::list<NodeTableEntry> available_pathes, Balancin
       return bestPath;
     }
     case BalancingAlgorithm::TX_DROP_THRESHOLD: {
-      uint32_t maximum = 0;
-      NodeTableEntry bestPath= (*it);
-      for (it = available_pathes.begin(); it != available_pathes.end(); ++it) {
-        uint32_t available_bytes = channelTable.GetAvailableBytes( (*it).channel_id );
+      uint64_t maximum = 0;
+      NodeTableEntry *bestPath = (*it);
+      for (it = candidates.begin(); it != candidates.end(); ++it) {
+        uint64_t available_bytes = channelTable.GetAvailableBytesAt( (*it)->channel_index );
         if ( available_bytes > maximum) {
-          NS_LOG_LOGIC( " Maximum " << available_bytes << " channel id: " << (*it).channel_id);
+          HOT_PATH_LOGIC( " Maximum " << available_bytes << " channel id: " << (*it)->channel_id);
           bestPath = (*it);
           maximum = available_bytes;
         }
@@ -272,11 +765,207 @@ NodeTable::ChooseBestPath ( std::list<NodeTableEntry> available_pathes, Balancin
       return bestPath;
       break;
     }
+    case BalancingAlgorithm::WEIGHTED_ROUND_ROBIN: {
+      // Smooth weighted round-robin: every candidate gains its weight, the
+      // heaviest one is picked and pays back the total weight
+      int64_t total_weight = 0;
+      NodeTableEntry *bestPath = (*it);
+      for (it = candidates.begin(); it != candidates.end(); ++it) {
+        int64_t weight = channelTable.GetChannelCapacityAt( (*it)->channel_index );
+        (*it)->wrr_current_weight += weight;
+        total_weight += weight;
+        if ( (*it)->wrr_current_weight > bestPath->wrr_current_weight ) {
+          bestPath = (*it);
+        }
+      }
+      bestPath->wrr_current_weight -= total_weight;
+      HOT_PATH_LOGIC( " Weighted round-robin picked channel id: " << bestPath->channel_id);
+      return bestPath;
+    }
+    case BalancingAlgorithm::FLOW_AFFINITY: {
+      return ChooseFlowAffinityPath( candidates, channelTable, flow_hash );
+    }
+    case BalancingAlgorithm::LOWEST_DELAY: {
+      // unmeasured channels report 0 and are therefore probed first
+      NodeTableEntry *bestPath = (*it);
+      double best_delay = channelTable.GetChannelDelayAt( (*it)->channel_index );
+      for (it = candidates.begin(); it != candidates.end(); ++it) {
+        double delay = channelTable.GetChannelDelayAt( (*it)->channel_index );
+        if ( delay < best_delay ) {
+          bestPath = (*it);
+          best_delay = delay;
+        }
+      }
+      HOT_PATH_LOGIC( " Lowest delay " << best_delay << " channel id: " << bestPath->channel_id);
+      return bestPath;
+    }
+    case BalancingAlgorithm::DELAY_CAPACITY: {
+      // cost = delay + time to push a reference packet through the spare capacity
+      NodeTableEntry *bestPath = (*it);
+      double best_cost = -1;
+      for (it = candidates.begin(); it != candidates.end(); ++it) {
+        uint64_t available = channelTable.GetChannelAvailableCapacityAt( (*it)->channel_index );
+        if (available == 0) {
+          continue;
+        }
+        double cost = channelTable.GetChannelDelayAt( (*it)->channel_index )
+                      + static_cast<double> (REFERENCE_PACKET_BITS) / available;
+        if ( best_cost < 0 || cost < best_cost ) {
+          bestPath = (*it);
+          best_cost = cost;
+        }
+      }
+      HOT_PATH_LOGIC( " Lowest cost " << best_cost << " channel id: " << bestPath->channel_id);
+      return bestPath;
+    }
+    case BalancingAlgorithm::DELIVERY_RATE: {
+      // capacity that actually gets through, minus what we already send
+      NodeTableEntry *bestPath = (*it);
+      double best_headroom = 0;
+      bool found = false;
+      for (it = candidates.begin(); it != candidates.end(); ++it) {
+        uint32_t index = (*it)->channel_index;
+        double loss = channelTable.GetChannelLossRatioAt( index );
+        double effective_capacity = channelTable.GetChannelCapacityAt( index ) * (1 - loss);
+        uint64_t delivered = channelTable.GetChannelDeliveryRateAt( index );
+        if (loss > SATURATION_LOSS && delivered > 0) {
+          // a lossy path is carrying all it can: its real bottleneck may be downstream
+          effective_capacity = std::min (effective_capacity, static_cast<double> (delivered));
+        }
+        double used = channelTable.GetChannelCapacityAt( index ) - channelTable.GetChannelAvailableCapacityAt( index );
+        double headroom = effective_capacity - used;
+        if ( !found || headroom > best_headroom ) {
+          bestPath = (*it);
+          best_headroom = headroom;
+          found = true;
+        }
+      }
+      HOT_PATH_LOGIC( " Best delivery headroom " << best_headroom << " channel id: " << bestPath->channel_id);
+      return bestPath;
+    }
+    case BalancingAlgorithm::PERCENTILE_RATE: {
+      uint64_t best_capacity = 0;
+      NodeTableEntry *bestPath = (*it);
+      for (it = candidates.begin(); it != candidates.end(); ++it) {
+        uint32_t index = (*it)->channel_index;
+        uint64_t capacity = channelTable.GetChannelCapacityAt( index );
+        uint64_t used = std::max (capacity - channelTable.GetChannelAvailableCapacityAt( index ),
+                                  channelTable.GetChannelP95UseAt( index ));
+        uint64_t available = used < capacity ? capacity - used : 0;
+        if ( available > best_capacity ) {
+          bestPath = (*it);
+          best_capacity = available;
+        }
+      }
+      HOT_PATH_LOGIC( " Best p95 capacity " << best_capacity << " channel id: " << bestPath->channel_id);
+      return bestPath;
+    }
     default:
       NS_ASSERT_MSG (false, " Balancing Algorithm not implemented ");
   }
   return (*it);
 }
+NodeTableEntry *
+NodeTable::ChooseSparePath ( const std::vector<NodeTableEntry *> &candidates, NodeTableEntry *chosen,
+                             const ChannelTable &channelTable )
+{
+  NodeTableEntry *sparePath = chosen;
+  uint64_t best_capacity = 0;
+  std::vector<NodeTableEntry *>::const_iterator it;
+  for (it = candidates.begin(); it != candidates.end(); ++it) {
+    if ((*it) == chosen) {
+      continue;
+    }
+    uint64_t available = channelTable.GetChannelAvailableCapacityAt( (*it)->channel_index );
+    if (sparePath == chosen || available > best_capacity) {
+      sparePath = (*it);
+      best_capacity = available;
+    }
+  }
+  return sparePath;
+}
+
+void
+NodeTable::SetAffinityThreshold( double utilisation )
+{
+  NS_ASSERT_MSG (utilisation > 0 && utilisation <= 1, "Affinity threshold must be in (0, 1]");
+  affinity_threshold = utilisation;
+}
+
+// splitmix64 finalizer, good enough to spread flow/channel pairs
+static uint64_t
+MixHash ( uint64_t x )
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static bool
+IsChannelOverloaded ( const ChannelTable &channelTable, uint32_t index, double threshold )
+{
+  uint64_t capacity = channelTable.GetChannelCapacityAt( index );
+  uint64_t use = capacity - channelTable.GetChannelAvailableCapacityAt( index );
+  return capacity == 0 || use >= threshold * capacity;
+}
+
+NodeTableEntry *
+NodeTable::ChooseFlowAffinityPath ( const std::vector<NodeTableEntry *> &candidates,
+                                    const ChannelTable &channelTable, uint64_t flow_hash )
+{
+  std::unordered_map<uint64_t, NodeTableEntry *>::iterator assigned = flow_assignments.find (flow_hash);
+  if (assigned != flow_assignments.end ()
+      && !IsChannelOverloaded( channelTable, assigned->second->channel_index, affinity_threshold ))
+    {
+      return assigned->second;
+    }
+  // Rendezvous hashing: the flow goes to the highest scoring channel that is
+  // not overloaded, so flows only move when their own channel fills up
+  NodeTableEntry *bestPath = 0;
+  NodeTableEntry *fallbackPath = 0;
+  uint64_t best_score = 0;
+  uint64_t fallback_score = 0;
+  std::vector<NodeTableEntry *>::const_iterator it;
+  for (it = candidates.begin(); it != candidates.end(); ++it) {
+    uint64_t score = MixHash( flow_hash ^ MixHash( (*it)->channel_id ) );
+    if (fallbackPath == 0 || score > fallback_score) {
+      fallbackPath = (*it);
+      fallback_score = score;
+    }
+    if (IsChannelOverloaded( channelTable, (*it)->channel_index, affinity_threshold )) {
+      continue;
+    }
+    if (bestPath == 0 || score > best_score) {
+      bestPath = (*it);
+      best_score = score;
+    }
+  }
+  if (bestPath == 0) {
+    // Every channel is overloaded, stay on the flow's natural channel
+    bestPath = fallbackPath;
+  }
+  if (assigned != flow_assignments.end () && assigned->second != bestPath) {
+    HOT_PATH_LOGIC( " Moving flow " << flow_hash << " from channel " << assigned->second->channel_id
+                  << " to channel " << bestPath->channel_id );
+  }
+  // A flow on its natural channel is found again by the hash, only the
+  // moved ones need remembering. The map is bounded: past the cap it is
+  // cleared and moved flows are placed again on their next packet
+  if (bestPath == fallbackPath) {
+    if (assigned != flow_assignments.end ()) {
+      flow_assignments.erase (assigned);
+    }
+    return bestPath;
+  }
+  if (assigned == flow_assignments.end () && flow_assignments.size () >= MAX_FLOW_ASSIGNMENTS) {
+    HOT_PATH_LOGIC( " Flow assignments full, forgetting " << flow_assignments.size () << " flows" );
+    flow_assignments.clear ();
+  }
+  flow_assignments[flow_hash] = bestPath;
+  return bestPath;
+}
+
 /* PathTable methods */
 PathTableEntry::PathTableEntry(Address addr, uint16_t port, uint32_t node, Ptr<Socket> socket)
 {
@@ -292,18 +981,6 @@ void
 PathTable::AddPathTableEntry( Address src_addr, uint16_t src_port, uint32_t node_id, Ptr<Socket> socket )  {
   entries.push_back( PathTableEntry( src_addr, src_port, node_id, socket ) );
 }
-uint32_t
-PathTable::FindDestinationNodeForPath ( Ipv4Address src_addr, uint16_t src_port ) {
-  std::list<PathTableEntry>::iterator it;
-  for (it = entries.begin(); it != entries.end(); ++it) {
-    InetSocketAddress socket_addr =
-      InetSocketAddress (Ipv4Address::ConvertFrom((*it).src_addr), (*it).src_port);
-    if (socket_addr.GetIpv4 () == src_addr && (*it).src_port == src_port) {
-      return (*it).node_id;
-    }
-  }
-  return NODE_ERROR;
-}
 void
 PathTable::LogPathTable( ) {
   std::list<PathTableEntry>::iterator it;
@@ -321,30 +998,413 @@ PathTable::LogPathTable( ) {
   }
   NS_LOG_INFO( "===========================================" );
 }
-
-
-uint16_t 
-PathTable::FindPortFromSocket ( Ptr<Socket> socket ) {
-  std::list<PathTableEntry>::iterator it;
-  for (it = entries.begin(); it != entries.end(); ++it) {
-    if ((*it).src_socket == socket) return (*it).src_port;
+/* FlowIndex methods */
+FlowIndexEntry::FlowIndexEntry()
+{
+  listen_port = 0;
+  node_id = NODE_ERROR;
+  flow_id = 0;
+  next_seq = 0;
+  fec_length = 0;
+  fec_count = 0;
+}
+FlowIndex::FlowIndex()
+{
+  origin_id = 0;
+  next_flow_id = 0;
+  valid = false;
+}
+void
+FlowIndex::ResetFecGroups ( ) {
+  std::unordered_map<uint64_t, FlowIndexEntry>::iterator it;
+  for (it = flows.begin (); it != flows.end (); ++it) {
+    it->second.fec_parity.clear ();
+    it->second.fec_length = 0;
+    it->second.fec_count = 0;
   }
-  return 0;
 }
-/* UdpMultipathRouter methods */
-TypeId
-UdpMultipathRouter::GetTypeId (void)
+void
+FlowIndex::SetOriginId ( uint32_t origin ) {
+  origin_id = origin;
+}
+// Sinks fed by several routers tell the flows apart by the router node id
+uint32_t
+FlowIndex::NextFlowId ( ) {
+  return ( origin_id << 16 ) | ( next_flow_id++ & 0xffff );
+}
+uint64_t
+FlowIndex::MakeKey ( uint16_t listen_port, Ipv4Address src_addr )
 {
-  static TypeId tid = TypeId ("ns3::UdpMultipathRouter")
-    .SetParent<Application> ()
-    .SetGroupName("Applications")
-    .AddConstructor<UdpMultipathRouter> ()
+  return ( static_cast<uint64_t> (listen_port) << 32 ) | src_addr.Get ();
+}
+uint64_t
+FlowIndex::MakeFlowHash ( Ipv4Address src_addr, uint16_t src_port, uint16_t listen_port )
+{
+  return ( static_cast<uint64_t> (src_addr.Get ()) << 32 )
+         | ( static_cast<uint64_t> (src_port) << 16 ) | listen_port;
+}
+void
+FlowIndex::Build ( PathTable &pathTable, NodeTable &nodeTable, const ChannelTable &channelTable )
+{
+  socket_ports.clear ();
+  socket_channels.clear ();
+  // flows keep their id, sequence numbers and FEC group across rebuilds
+  std::unordered_map<uint64_t, FlowIndexEntry> previous;
+  previous.swap (flows);
+  // Group node entries once, so building stays linear in the table sizes
+  std::unordered_map<uint32_t, std::vector<NodeTableEntry *> > node_channels;
+  std::list<NodeTableEntry>::iterator node_it;
+  for (node_it = nodeTable.entries.begin(); node_it != nodeTable.entries.end(); ++node_it) {
+    (*node_it).channel_index = channelTable.GetChannelIndex( (*node_it).channel_id );
+    NS_ASSERT_MSG ((*node_it).channel_index != ChannelTable::INVALID_INDEX,
+                   "Path uses unknown channel id " << (*node_it).channel_id);
+    if ((*node_it).dest_socket != 0) {
+      socket_channels[PeekPointer ((*node_it).dest_socket)] = (*node_it).channel_index;
+    }
+    node_channels[(*node_it).node_id].push_back( &(*node_it) );
+  }
+  std::list<PathTableEntry>::iterator it;
+  for (it = pathTable.entries.begin(); it != pathTable.entries.end(); ++it) {
+    if ((*it).src_socket != 0) {
+      socket_ports[PeekPointer ((*it).src_socket)] = (*it).src_port;
+    }
+    if ((*it).node_id == NODE_ERROR) {
+      continue; // transit port, its packets are routed by their tag
+    }
+    uint64_t key = MakeKey ((*it).src_port, Ipv4Address::ConvertFrom ((*it).src_addr));
+    FlowIndexEntry &flow = flows[key];
+    std::unordered_map<uint64_t, FlowIndexEntry>::iterator old = previous.find (key);
+    if (old != previous.end ()) {
+      flow = old->second;
+    } else if (flow.candidates.empty ()) {
+      flow.flow_id = NextFlowId ();
+    }
+    flow.listen_port = (*it).src_port;
+    flow.node_id = (*it).node_id;
+    flow.candidates = node_channels[(*it).node_id];
+  }
+  nodes.clear ();
+  std::unordered_map<uint32_t, std::vector<NodeTableEntry *> >::iterator node_channel;
+  for (node_channel = node_channels.begin (); node_channel != node_channels.end (); ++node_channel) {
+    FlowIndexEntry &node = nodes[node_channel->first];
+    node.node_id = node_channel->first;
+    node.candidates = node_channel->second;
+  }
+  valid = true;
+  NS_LOG_LOGIC( "Built flow index with " << flows.size () << " flows" );
+}
+void
+FlowIndex::Invalidate ( )
+{
+  valid = false;
+}
+bool
+FlowIndex::IsValid ( ) const
+{
+  return valid;
+}
+uint16_t
+FlowIndex::FindPortFromSocket ( Ptr<Socket> socket ) const
+{
+  std::unordered_map<Socket *, uint16_t>::const_iterator it = socket_ports.find (PeekPointer (socket));
+  return it != socket_ports.end () ? it->second : 0;
+}
+uint32_t
+FlowIndex::FindChannelIndexFromSocket ( Ptr<Socket> socket ) const
+{
+  std::unordered_map<Socket *, uint32_t>::const_iterator it = socket_channels.find (PeekPointer (socket));
+  return it != socket_channels.end () ? it->second : ChannelTable::INVALID_INDEX;
+}
+FlowIndexEntry *
+FlowIndex::Lookup ( uint16_t listen_port, Ipv4Address src_addr )
+{
+  std::unordered_map<uint64_t, FlowIndexEntry>::iterator it = flows.find (MakeKey (listen_port, src_addr));
+  return it != flows.end () ? &it->second : 0;
+}
+FlowIndexEntry *
+FlowIndex::LookupNode ( uint32_t node_id )
+{
+  std::unordered_map<uint32_t, FlowIndexEntry>::iterator it = nodes.find (node_id);
+  return it != nodes.end () ? &it->second : 0;
+}
+
+void
+FlowIndex::AddNextHop ( NodeTableEntry *entry )
+{
+  if (entry->dest_socket != 0) {
+    socket_channels[PeekPointer (entry->dest_socket)] = entry->channel_index;
+  }
+  FlowIndexEntry &node = nodes[entry->node_id];
+  node.node_id = entry->node_id;
+  node.candidates.push_back( entry );
+  std::unordered_map<uint64_t, FlowIndexEntry>::iterator it;
+  for (it = flows.begin (); it != flows.end (); ++it) {
+    if (it->second.node_id == entry->node_id) {
+      it->second.candidates.push_back( entry );
+    }
+  }
+}
+static void
+EraseCandidate ( std::vector<NodeTableEntry *> &candidates, NodeTableEntry *entry )
+{
+  candidates.erase (std::remove (candidates.begin (), candidates.end (), entry), candidates.end ());
+}
+void
+FlowIndex::RemoveNextHop ( NodeTableEntry *entry )
+{
+  if (entry->dest_socket != 0) {
+    socket_channels.erase (PeekPointer (entry->dest_socket));
+  }
+  std::unordered_map<uint32_t, FlowIndexEntry>::iterator node = nodes.find (entry->node_id);
+  if (node != nodes.end ()) {
+    EraseCandidate( node->second.candidates, entry );
+  }
+  std::unordered_map<uint64_t, FlowIndexEntry>::iterator it;
+  for (it = flows.begin (); it != flows.end (); ++it) {
+    if (it->second.node_id == entry->node_id) {
+      EraseCandidate( it->second.candidates, entry );
+    }
+  }
+}
+void
+FlowIndex::AddPath ( const PathTableEntry &entry )
+{
+  if (entry.src_socket != 0) {
+    socket_ports[PeekPointer (entry.src_socket)] = entry.src_port;
+  }
+  if (entry.node_id == NODE_ERROR) {
+    return; // transit port
+  }
+  uint64_t key = MakeKey (entry.src_port, Ipv4Address::ConvertFrom (entry.src_addr));
+  std::unordered_map<uint64_t, FlowIndexEntry>::iterator existing = flows.find (key);
+  FlowIndexEntry &flow = flows[key];
+  if (existing == flows.end ()) {
+    flow.flow_id = NextFlowId ();
+  }
+  flow.listen_port = entry.src_port;
+  flow.node_id = entry.node_id;
+  std::unordered_map<uint32_t, FlowIndexEntry>::const_iterator node = nodes.find (entry.node_id);
+  if (node != nodes.end ()) {
+    flow.candidates = node->second.candidates;
+  } else {
+    flow.candidates.clear ();
+  }
+}
+void
+FlowIndex::RemovePath ( const PathTableEntry &entry, bool socket_closed )
+{
+  if (socket_closed && entry.src_socket != 0) {
+    socket_ports.erase (PeekPointer (entry.src_socket));
+  }
+  if (entry.node_id != NODE_ERROR) {
+    flows.erase (MakeKey (entry.src_port, Ipv4Address::ConvertFrom (entry.src_addr)));
+  }
+}
+
+/* EgressQueue methods */
+ProbeRecord::ProbeRecord ()
+{
+  seq = 0;
+  pending = false;
+}
+EgressQueueItem::EgressQueueItem (Ptr<Packet> p, NodeTableEntry *entry)
+{
+  packet = p;
+  path = entry;
+  enqueue_time = Simulator::Now ();
+}
+EgressQueue::EgressQueue()
+{
+  bytes = 0;
+  next_transmit = Seconds (0);
+  red_average = 0;
+  red_count = 0;
+  codel_first_above_time = Seconds (0);
+  codel_drop_next = Seconds (0);
+  codel_count = 0;
+  codel_dropping = false;
+  pie_probability = 0;
+  pie_last_update = Seconds (0);
+  pie_old_delay = 0;
+}
+
+// RED, called on enqueue: thresholds at 1/4 and 3/4 of the queue depth
+bool
+EgressQueue::RedDrop (uint32_t depth, double random)
+{
+  double min_th = std::max (1.0, depth / 4.0);
+  double max_th = std::max (min_th + 1, 3.0 * depth / 4.0);
+  red_average = (1 - RED_QUEUE_WEIGHT) * red_average + RED_QUEUE_WEIGHT * items.size ();
+  if (red_average < min_th)
+    {
+      red_count = 0;
+      return false;
+    }
+  if (red_average >= max_th)
+    {
+      red_count = 0;
+      return true;
+    }
+  double pb = RED_MAX_PROBABILITY * (red_average - min_th) / (max_th - min_th);
+  double pa = red_count * pb < 1 ? pb / (1 - red_count * pb) : 1;
+  if (random < pa)
+    {
+      red_count = 0;
+      return true;
+    }
+  red_count++;
+  return false;
+}
+
+// CoDel, called for the head packet on dequeue
+bool
+EgressQueue::CodelDrop (const EgressQueueItem &item, Time now)
+{
+  Time sojourn = now - item.enqueue_time;
+  bool ok_to_drop = false;
+  if (sojourn < CODEL_TARGET || bytes <= CODEL_MTU)
+    {
+      codel_first_above_time = Seconds (0);
+    }
+  else if (codel_first_above_time.IsZero ())
+    {
+      codel_first_above_time = now + CODEL_INTERVAL;
+    }
+  else if (now >= codel_first_above_time)
+    {
+      ok_to_drop = true;
+    }
+
+  if (codel_dropping)
+    {
+      if (!ok_to_drop)
+        {
+          codel_dropping = false;
+          return false;
+        }
+      if (now >= codel_drop_next)
+        {
+          codel_count++;
+          codel_drop_next = codel_drop_next + Seconds (CODEL_INTERVAL.GetSeconds () / std::sqrt (codel_count));
+          return true;
+        }
+      return false;
+    }
+  if (ok_to_drop)
+    {
+      codel_dropping = true;
+      // reuse the last drop rate if we were dropping recently
+      Time since_last = now - codel_drop_next;
+      codel_count = (codel_count > 2 && since_last < CODEL_INTERVAL * 16) ? codel_count - 2 : 1;
+      codel_drop_next = now + Seconds (CODEL_INTERVAL.GetSeconds () / std::sqrt (codel_count));
+      return true;
+    }
+  return false;
+}
+
+// PIE, called on enqueue: the drop probability is updated every PIE_UPDATE_PERIOD
+bool
+EgressQueue::PieDrop (uint64_t capacity, double random, Time now)
+{
+  double delay = capacity > 0 ? bytes * 8.0 / capacity : 0;
+  if (now - pie_last_update >= PIE_UPDATE_PERIOD)
+    {
+      // scale the gains down while the probability is small (RFC 8033 section 4.2)
+      double scale = 1;
+      if (pie_probability < 0.000001) scale = 1 / 2048.0;
+      else if (pie_probability < 0.00001) scale = 1 / 512.0;
+      else if (pie_probability < 0.0001) scale = 1 / 128.0;
+      else if (pie_probability < 0.001) scale = 1 / 32.0;
+      else if (pie_probability < 0.01) scale = 1 / 8.0;
+      else if (pie_probability < 0.1) scale = 1 / 2.0;
+      pie_probability += scale * (PIE_ALPHA * (delay - PIE_TARGET) + PIE_BETA * (delay - pie_old_delay));
+      pie_probability = std::max (0.0, std::min (1.0, pie_probability));
+      pie_old_delay = delay;
+      pie_last_update = now;
+    }
+  if (delay < PIE_TARGET / 2 && pie_probability < 0.2)
+    {
+      return false;
+    }
+  return random < pie_probability;
+}
+
+/* UdpMultipathRouter methods */
+TypeId
+UdpMultipathRouter::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::UdpMultipathRouter")
+    .SetParent<Application> ()
+    .SetGroupName("Applications")
+    .AddConstructor<UdpMultipathRouter> ()
+    // Set only: they configure the tables, which are not readable as one value
+    .AddAttribute ("BalancingAlgorithm", "How packets are spread over the channels of a destination.",
+                   TypeId::ATTR_SET | TypeId::ATTR_CONSTRUCT,
+                   EnumValue (static_cast<int> (BalancingAlgorithm::TX_RATE)),
+                   MakeEnumAccessor (&UdpMultipathRouter::SetLoadBalancing),
+                   MakeEnumChecker (static_cast<int> (BalancingAlgorithm::NO_BALANCING), "NoBalancing",
+                                    static_cast<int> (BalancingAlgorithm::TX_RATE), "TxRate",
+                                    static_cast<int> (BalancingAlgorithm::TX_DROP_THRESHOLD), "TxDropThreshold",
+                                    static_cast<int> (BalancingAlgorithm::WEIGHTED_ROUND_ROBIN), "WeightedRoundRobin",
+                                    static_cast<int> (BalancingAlgorithm::FLOW_AFFINITY), "FlowAffinity",
+                                    static_cast<int> (BalancingAlgorithm::LOWEST_DELAY), "LowestDelay",
+                                    static_cast<int> (BalancingAlgorithm::DELAY_CAPACITY), "DelayCapacity",
+                                    static_cast<int> (BalancingAlgorithm::DELIVERY_RATE), "DeliveryRate",
+                                    static_cast<int> (BalancingAlgorithm::PERCENTILE_RATE), "PercentileRate"))
+    .AddAttribute ("DropMode", "When packets over the channel capacity are dropped.",
+                   TypeId::ATTR_SET | TypeId::ATTR_CONSTRUCT,
+                   EnumValue (static_cast<int> (DropMode::TX_RATE)),
+                   MakeEnumAccessor (&UdpMultipathRouter::SetDropMode),
+                   MakeEnumChecker (static_cast<int> (DropMode::NO_DROPPING), "NoDropping",
+                                    static_cast<int> (DropMode::TX_RATE), "TxRate",
+                                    static_cast<int> (DropMode::TX_DROP_THRESHOLD), "TxDropThreshold",
+                                    static_cast<int> (DropMode::TOKEN_BUCKET), "TokenBucket"))
+    .AddAttribute ("RefreshInterval", "Length of the intervals over which channel use is measured.",
+                   TypeId::ATTR_SET | TypeId::ATTR_CONSTRUCT,
+                   TimeValue (Seconds (CHANNEL_TABLE_REFRESH_RATE)),
+                   MakeTimeAccessor (&UdpMultipathRouter::SetRefreshInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("Channels", "Channels to add, \"<id> <capacity Mbps>\" separated by ';'.",
+                   TypeId::ATTR_SET | TypeId::ATTR_CONSTRUCT,
+                   StringValue (""),
+                   MakeStringAccessor (&UdpMultipathRouter::AddChannels),
+                   MakeStringChecker ())
+    .AddAttribute ("Paths", "Paths to add, \"<src addr> <src port> <next hop addr> <next hop port> "
+                   "<node id> <channel id>\" separated by ';'.",
+                   TypeId::ATTR_SET | TypeId::ATTR_CONSTRUCT,
+                   StringValue (""),
+                   MakeStringAccessor (&UdpMultipathRouter::AddPaths),
+                   MakeStringChecker ())
+    .AddAttribute ("TablesFile", "Text file with the routing tables, loaded when the application starts.",
+                   TypeId::ATTR_SET | TypeId::ATTR_CONSTRUCT,
+                   StringValue (""),
+                   MakeStringAccessor (&UdpMultipathRouter::SetTablesFile),
+                   MakeStringChecker ())
     .AddTraceSource ("Rx", "A packet has been received",
                      MakeTraceSourceAccessor (&UdpMultipathRouter::m_rxTrace),
                      "ns3::Packet::TracedCallback")
     .AddTraceSource ("RxWithAddresses", "A packet has been received",
                      MakeTraceSourceAccessor (&UdpMultipathRouter::m_rxTraceWithAddresses),
                      "ns3::Packet::TwoAddressTracedCallback")
+    .AddTraceSource ("Tx", "A packet has been sent",
+                     MakeTraceSourceAccessor (&UdpMultipathRouter::m_txTrace),
+                     "ns3::Packet::TracedCallback")
+    .AddTraceSource ("TxWithAddresses", "A packet has been sent",
+                     MakeTraceSourceAccessor (&UdpMultipathRouter::m_txTraceWithAddresses),
+                     "ns3::Packet::TwoAddressTracedCallback")
+    .AddTraceSource ("Route", "A packet has been assigned a destination node and channel",
+                     MakeTraceSourceAccessor (&UdpMultipathRouter::m_routeTrace),
+                     "ns3::UdpMultipathRouter::RouteTracedCallback")
+    .AddTraceSource ("Drop", "A packet has been dropped, with its channel id "
+                     "(ChannelTable::NO_CHANNEL_ID before a channel was chosen)",
+                     MakeTraceSourceAccessor (&UdpMultipathRouter::m_dropTrace),
+                     "ns3::UdpMultipathRouter::DropTracedCallback")
+    .AddTraceSource ("ChannelRate", "Estimated sending rate of a channel, in bits/s",
+                     MakeTraceSourceAccessor (&UdpMultipathRouter::m_channelRateTrace),
+                     "ns3::UdpMultipathRouter::ChannelRateTracedCallback")
+    .AddTraceSource ("QueueLength", "Packets in the egress queue of a channel",
+                     MakeTraceSourceAccessor (&UdpMultipathRouter::m_queueLengthTrace),
+                     "ns3::UdpMultipathRouter::ChannelValueTracedCallback")
   ;
   return tid;
 }
@@ -352,9 +1412,24 @@ UdpMultipathRouter::GetTypeId (void)
 UdpMultipathRouter::UdpMultipathRouter ()
 {
   NS_LOG_FUNCTION (this);
-  m_sendEvent = EventId ();
   balancingAlgorithm = BalancingAlgorithm::TX_RATE;
   dropMode = DropMode::TX_RATE;
+  forwardingMode = ForwardingMode::ZERO_COPY;
+  shaperQueueing = false;
+  delayProbing = false;
+  probeSeq = 0;
+  m_probes.resize (PROBE_WINDOW);
+  multipathHeader = false;
+  reportPort = 0;
+  receiveBudget = DEFAULT_RECEIVE_BUDGET;
+  pathTags = false;
+  redundancyMode = RedundancyMode::NONE;
+  fecGroupSize = 4;
+  queueDepth = 0;
+  queueDropPolicy = QueueDropPolicy::DROP_TAIL;
+  queueDiscipline = QueueDiscipline::FIFO;
+  m_aqmRandom = CreateObject<UniformRandomVariable> ();
+  running = false;
 }
 
 UdpMultipathRouter::~UdpMultipathRouter()
@@ -366,6 +1441,15 @@ void
 UdpMultipathRouter::DoDispose (void)
 {
   NS_LOG_FUNCTION (this);
+  CancelPendingSends ();
+  CancelPendingReads ();
+  FlushQueues ();
+  egressQueues.clear ();
+  m_aqmRandom = 0;
+  m_reportSocket = 0;
+  channelTable.SetRateCallback (MakeNullCallback<void, uint32_t, Time, uint64_t, uint64_t> ());
+  channelTable.SetStatsWriter (0);
+  m_statsWriter.Close ();
   Application::DoDispose ();
   /*
   ChannelTable::DoDispose ();
@@ -430,14 +1514,24 @@ UdpMultipathRouter::initSendingSocket (Ptr<Socket> socket, uint16_t m_port, Addr
     }
   NS_LOG_INFO("Initialized sending socket..." << socket);
   socket->SetAllowBroadcast (true);
+  // echoes of delay probes come back on the sending socket
+  socket->SetRecvCallback (MakeCallback (&UdpMultipathRouter::HandleEcho, this));
   return socket;
 }
 
 void
 UdpMultipathRouter::initReceivingSockets( ) {
+  // one socket per listen port, shared by every path entry on it
+  std::unordered_map<uint16_t, Ptr<Socket> > port_sockets;
   std::list<PathTableEntry>::iterator it;
   for ( it = pathTable.entries.begin(); it != pathTable.entries.end(); ++it ) {
+    Ptr<Socket> &shared = port_sockets[(*it).src_port];
+    if ( (*it).src_socket == 0 && shared != 0 ) {
+      (*it).src_socket = shared;
+      continue;
+    }
     (*it).src_socket = UdpMultipathRouter::initReceivingSocket( (*it).src_socket, (*it).src_port);
+    shared = (*it).src_socket;
   }
 }
 
@@ -447,6 +1541,9 @@ UdpMultipathRouter::initSendingSockets ( ) {
   for ( it = nodeTable.entries.begin(); it != nodeTable.entries.end(); ++it ) {
     (*it).dest_socket = UdpMultipathRouter::initSendingSocket ( (*it).dest_socket,
                                                                 (*it).dest_port, (*it).dest_addr ); 
+    // resolved once, so the Tx traces do no address work per packet
+    (*it).dest_socket->GetSockName ( (*it).local_addr );
+    (*it).remote_addr = InetSocketAddress ( Ipv4Address::ConvertFrom ((*it).dest_addr), (*it).dest_port );
   }
 }
 
@@ -455,6 +1552,12 @@ UdpMultipathRouter::closeReceivingSocket(Ptr<Socket> socket)
 {
   if (socket != 0) 
     {
+      std::unordered_map<Socket *, EventId>::iterator pending = m_readEvents.find (PeekPointer (socket));
+      if (pending != m_readEvents.end ())
+        {
+          Simulator::Cancel (pending->second);
+          m_readEvents.erase (pending);
+        }
       socket->Close ();
       socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
     }
@@ -471,19 +1574,44 @@ void
 UdpMultipathRouter::StartApplication (void)
 {
   NS_LOG_FUNCTION (this);
+  if (!m_tablesFile.empty ())
+    {
+      UdpMultipathRouter::LoadTablesFile ( );
+    }
   UdpMultipathRouter::initReceivingSockets ( );
   UdpMultipathRouter::initSendingSockets ( );
+  flowIndex.SetOriginId( GetNode ()->GetId () );
+  UdpMultipathRouter::BuildFlowIndex ( );
+  if (reportPort != 0)
+    {
+      m_reportSocket = UdpMultipathRouter::initReceivingSocket ( m_reportSocket, reportPort );
+      m_reportSocket->SetRecvCallback (MakeCallback (&UdpMultipathRouter::HandleReport, this));
+    }
+  if (UdpMultipathRouter::IsProbing () && (!multipathHeader || reportPort == 0))
+    {
+      NS_LOG_WARN ("Delay probing without the multipath header and receiver reports: "
+                   "the next hops must echo every packet, or they see the probes as payload");
+    }
+  channelTable.SetRateCallback( MakeCallback (&UdpMultipathRouter::NotifyChannelRate, this) );
   channelTable.ScheduleChannelTableUpdate( Seconds ( 1.0 ) );
-  channelTable.ScheduleChannelLog( );
   nodeTable.LogNodeTable();
   pathTable.LogPathTable();
+  running = true;
 }
 
 void 
 UdpMultipathRouter::StopApplication ()
 {
   NS_LOG_FUNCTION (this);
+  running = false;
   UdpMultipathRouter::closeReceivingSockets ( );
+  UdpMultipathRouter::closeReceivingSocket ( m_reportSocket );
+  UdpMultipathRouter::CancelPendingSends ( );
+  UdpMultipathRouter::CancelPendingReads ( );
+  // close the intervals that ended while idle, for the logs and stats file;
+  // the flushed packets then count as drops of the interval open now
+  channelTable.UpdateChannelsCurrentUse ( );
+  UdpMultipathRouter::FlushQueues ( );
 }
 
 void
@@ -498,141 +1626,1108 @@ UdpMultipathRouter::SetDropMode ( DropMode drop)
   UdpMultipathRouter::dropMode = drop; 
 };
 
+void
+UdpMultipathRouter::SetRateEstimator ( RateEstimator estimator )
+{
+  channelTable.SetRateEstimator( estimator );
+};
+
+void
+UdpMultipathRouter::SetEwmaAlpha ( double alpha )
+{
+  channelTable.SetEwmaAlpha( alpha );
+};
+
+void
+UdpMultipathRouter::SetRateWindow ( uint32_t intervals )
+{
+  channelTable.SetRateWindow( intervals );
+};
+
+void
+UdpMultipathRouter::SetHistorySize ( uint32_t intervals )
+{
+  channelTable.SetHistorySize( intervals );
+};
+
+void
+UdpMultipathRouter::SetRefreshInterval ( Time interval )
+{
+  channelTable.SetRefreshInterval( interval );
+};
+
+void
+UdpMultipathRouter::SetFlowAffinityThreshold ( double utilisation )
+{
+  nodeTable.SetAffinityThreshold( utilisation );
+};
+
+void
+UdpMultipathRouter::SetShaperBurst ( uint32_t bytes )
+{
+  channelTable.SetShaperBurst( bytes );
+};
+
+void
+UdpMultipathRouter::SetShaperQueueing ( bool queueing )
+{
+  UdpMultipathRouter::shaperQueueing = queueing;
+};
+
+void
+UdpMultipathRouter::SetEgressQueue ( uint32_t depth, QueueDropPolicy policy )
+{
+  UdpMultipathRouter::queueDepth = depth;
+  UdpMultipathRouter::queueDropPolicy = policy;
+};
+
+void
+UdpMultipathRouter::SetQueueDiscipline ( QueueDiscipline discipline )
+{
+  UdpMultipathRouter::queueDiscipline = discipline;
+};
+
+void
+UdpMultipathRouter::SetDelayProbing ( bool probing )
+{
+  UdpMultipathRouter::delayProbing = probing;
+};
+
+void
+UdpMultipathRouter::SetMultipathHeader ( bool stamp )
+{
+  UdpMultipathRouter::multipathHeader = stamp;
+};
+
+void
+UdpMultipathRouter::SetReceiverReports ( uint16_t report_port )
+{
+  UdpMultipathRouter::reportPort = report_port;
+  // the sinks need the channel header to tell the channels apart
+  UdpMultipathRouter::multipathHeader = multipathHeader || report_port != 0;
+};
+
+void
+UdpMultipathRouter::SetReceiveBudget ( uint32_t packets )
+{
+  UdpMultipathRouter::receiveBudget = packets;
+};
+
+void
+UdpMultipathRouter::SetStatsFile ( std::string path )
+{
+  if (!m_statsWriter.Open (path))
+    {
+      NS_FATAL_ERROR ("Could not open stats file " << path);
+    }
+  channelTable.SetStatsWriter (&m_statsWriter);
+};
+
+void
+UdpMultipathRouter::SetPathTags ( bool tags )
+{
+  UdpMultipathRouter::pathTags = tags;
+  // the tag is carried by the multipath header
+  UdpMultipathRouter::multipathHeader = multipathHeader || tags;
+};
+
+void
+UdpMultipathRouter::SetRedundancy ( RedundancyMode mode, uint8_t fec_group_size )
+{
+  NS_ASSERT_MSG (fec_group_size >= 2 && fec_group_size <= 32, "FEC group size must be in [2, 32]");
+  UdpMultipathRouter::redundancyMode = mode;
+  UdpMultipathRouter::fecGroupSize = fec_group_size;
+  // a group open under the old size would never be closed consistently
+  flowIndex.ResetFecGroups( );
+  // the sink needs flow sequence numbers to remove duplicates and recover packets
+  UdpMultipathRouter::multipathHeader = multipathHeader || mode != RedundancyMode::NONE;
+};
+
+void
+UdpMultipathRouter::SetForwardingMode ( ForwardingMode mode )
+{
+  UdpMultipathRouter::forwardingMode = mode;
+};
+
 
 void 
 UdpMultipathRouter::HandleRead (Ptr<Socket> socket)
 {
   NS_LOG_FUNCTION (this << socket);
 
+  if (!running)
+    {
+      return; // a continuation that was not cancelled in time
+    }
+  if (!flowIndex.IsValid ())
+    {
+      UdpMultipathRouter::BuildFlowIndex ( );
+    }
+  // Resolved once per batch: the socket fixes the listen port and local address
+  uint16_t listen_port = flowIndex.FindPortFromSocket(socket);
+  if (listen_port == 0)
+    {
+      NS_LOG_LOGIC ("Socket of a removed path, nothing to read");
+      return;
+    }
+  // the whole batch is routed at the same simulation time
+  channelTable.UpdateChannelsCurrentUse ( );
+  Address localAddress;
+  socket->GetSockName (localAddress);
+
   Ptr<Packet> packet;
   Address from;
-  Address localAddress;
-  while ((packet = socket->RecvFrom (from)))
+  uint32_t received = 0;
+  // consecutive packets of one source are a run, and share the flow lookup
+  bool in_run = false;
+  Ipv4Address run_addr;
+  uint16_t run_port = 0;
+  FlowIndexEntry *flow = 0;
+  uint64_t flow_hash = 0;
+  while ((receiveBudget == 0 || received < receiveBudget) && (packet = socket->RecvFrom (from)))
     {
-      socket->GetSockName (localAddress);
+      received++;
       m_rxTrace (packet);
       m_rxTraceWithAddresses (packet, from, localAddress);
-      if (InetSocketAddress::IsMatchingType (from))
+      NS_ASSERT_MSG (InetSocketAddress::IsMatchingType (from), "Incompatible address type: " << from);
+      InetSocketAddress from_addr = InetSocketAddress::ConvertFrom (from);
+      HOT_PATH_LOGIC ("At time " << Simulator::Now ().GetSeconds () 
+        << "s router received " << packet->GetSize () << " bytes from "
+        << from_addr.GetIpv4 () << " port " << from_addr.GetPort ());
+      if (!in_run || from_addr.GetIpv4 () != run_addr || from_addr.GetPort () != run_port)
         {
-          NS_LOG_LOGIC ("At time " << Simulator::Now ().GetSeconds () 
-            << "s router received " << packet->GetSize () << " bytes from "
-            << InetSocketAddress::ConvertFrom (from).GetIpv4 () << " port "
-            << InetSocketAddress::ConvertFrom (from).GetPort ());
+          in_run = true;
+          run_addr = from_addr.GetIpv4 ();
+          run_port = from_addr.GetPort ();
+          flow = flowIndex.Lookup( listen_port, run_addr );
+          flow_hash = FlowIndex::MakeFlowHash( run_addr, run_port, listen_port );
         }
-      else {
-        NS_ASSERT_MSG (false, "Incompatible address type: " << from);
-      }
-      // TODO: find a way to get the listen port here
-      UdpMultipathRouter::RoutePacket(packet->GetSize(), from, socket);
+      // Packet tags are local to this hop (socket tags), byte tags travel end-to-end
       packet->RemoveAllPacketTags ();
-      packet->RemoveAllByteTags ();
-  }
-}
-void
-UdpMultipathRouter::RoutePacket (uint32_t packet_size, Address from, Ptr<Socket> socket)
-{
-      NS_LOG_LOGIC("Routing packet to destination... ");
-//      uint16_t connection_port = InetSocketAddress::ConvertFrom (from).GetPort ();
-      uint16_t listen_port;
-      // TODO: build a better way to find the socket listening port
-      // Problem: using socket memory address as comparison and not a proper value for this
-      listen_port = pathTable.FindPortFromSocket(socket);
-      if (listen_port == 0 )
-        {
-          NS_ASSERT_MSG (false, "Could not find listen port");
-        }
-      NS_LOG_LOGIC("Found listen port: " << listen_port);
-      // TODO: finish routing here
-      uint32_t node_id = pathTable.FindDestinationNodeForPath( InetSocketAddress::ConvertFrom(from).GetIpv4( ),
-                                                               listen_port );
-      NS_ASSERT_MSG( (node_id != NODE_ERROR), "Could not find node to route to!" );
-      NS_LOG_LOGIC("Found node ID: " << node_id);
-      std::list<NodeTableEntry> available_channels = nodeTable.GetAvailableChannels ( node_id );
-      NS_LOG_LOGIC("Found " << available_channels.size() << " available channels ");
-      NodeTableEntry chosenPath = nodeTable.ChooseBestPath( available_channels,
-                                                            UdpMultipathRouter::balancingAlgorithm,
-                                                            channelTable );
-      // Packet loss mechanism
-      uint32_t drop_test = 0;
-      switch (UdpMultipathRouter::dropMode) {
-        case DropMode::NO_DROPPING: {
-              drop_test = 1;
-              break;
+      UdpMultipathRouter::RoutePacket(packet, flow, flow_hash);
+    }
+  if (receiveBudget != 0 && received == receiveBudget && socket->GetRxAvailable () > 0)
+    {
+      // out of budget: let other sockets and events run, then continue this one
+      m_readEvents[PeekPointer (socket)] = Simulator::ScheduleNow (&UdpMultipathRouter::HandleRead, this, socket);
+    }
+}
+
+void
+UdpMultipathRouter::CancelPendingReads (void)
+{
+  std::unordered_map<Socket *, EventId>::iterator it;
+  for (it = m_readEvents.begin (); it != m_readEvents.end (); ++it)
+    {
+      Simulator::Cancel (it->second);
+    }
+  m_readEvents.clear ();
+}
+void
+UdpMultipathRouter::BuildFlowIndex ( )
+{
+  flowIndex.Build( pathTable, nodeTable, channelTable );
+  egressQueues.resize( channelTable.GetChannelCount () );
+}
+
+void
+UdpMultipathRouter::HandleEcho (Ptr<Socket> socket)
+{
+  NS_LOG_FUNCTION (this << socket);
+  Ptr<Packet> packet;
+  Address from;
+  uint32_t channel_index = flowIndex.FindChannelIndexFromSocket (socket);
+  bool probing = UdpMultipathRouter::IsProbing ();
+  while ((packet = socket->RecvFrom (from)))
+    {
+      SeqTsHeader probe;
+      UdpMultipathHeader header;
+      uint32_t header_size = multipathHeader ? header.GetSerializedSize () : 0;
+      if (!probing || channel_index == ChannelTable::INVALID_INDEX
+          || packet->GetSize () < header_size + probe.GetSerializedSize ())
+        {
+          continue; // nothing was probed: whatever comes back is not an echo
         }
-        case DropMode::TX_RATE: {
-          drop_test = channelTable.GetChannelAvailableCapacity(chosenPath.channel_id);
-          NS_LOG_LOGIC (" Available capacity: " << drop_test);
-          break;
+      if (multipathHeader)
+        {
+          // the multipath header is outermost, the probe sits right below it
+          packet->RemoveHeader (header);
+          if (!header.IsValid () || !header.HasProbe ())
+            {
+              continue;
+            }
         }
-        case DropMode::TX_DROP_THRESHOLD: {
-          drop_test = channelTable.GetAvailableBytes(chosenPath.channel_id);
-          NS_LOG_LOGIC (" Available bytes : " << drop_test);
-          break;
+      packet->RemoveHeader (probe);
+      // only the echo of a probe still outstanding, with its own timestamp, counts
+      if (!UdpMultipathRouter::MatchProbe (probe.GetSeq (), probe.GetTs ()))
+        {
+          HOT_PATH_LOGIC ("Ignored echo of unknown probe " << probe.GetSeq ());
+          continue;
         }
-        default:
-          NS_ASSERT_MSG (false, "Invalid drop mode" );
-      }
-      
-      if (drop_test == 0) {
-        // Dropped Packet
-        NS_LOG_LOGIC("Dropped packet... " << chosenPath.channel_id);
-        channelTable.AddDroppedPacket( chosenPath.channel_id );
-      } else {
-      NS_LOG_LOGIC("Picked channel... " << chosenPath.channel_id);
-      NS_LOG_LOGIC("Testing destination address and port");
-      CheckIpv4(chosenPath.dest_addr, chosenPath.dest_port);
-      NS_LOG_LOGIC (
-                    "At time " << Simulator::Now ().GetSeconds () << " routing of packet (" << packet_size 
-                    << " bytes) from " << InetSocketAddress::ConvertFrom(from).GetIpv4() 
-                    << " port: " << listen_port
-                    << " to "  << Ipv4Address::ConvertFrom (chosenPath.dest_addr) 
-                    << " port: " << chosenPath.dest_port
-                   );
-      UdpMultipathRouter::Send (packet_size, chosenPath.dest_socket, chosenPath.dest_addr, chosenPath.dest_port);
-//      UdpMultipathRouter::ScheduleTransmit (Simulator::Now (), packet_size, tmp_socket, tmp_addr, send_port);
-      }
+      Time rtt = Simulator::Now () - probe.GetTs ();
+      HOT_PATH_LOGIC ("Echo of probe " << probe.GetSeq () << " rtt " << rtt.GetSeconds ());
+      channelTable.UpdateChannelDelayAt (channel_index, rtt);
+    }
 }
 
+bool
+UdpMultipathRouter::MatchProbe (uint32_t seq, Time sent)
+{
+  ProbeRecord &record = m_probes[seq % PROBE_WINDOW];
+  if (!record.pending || record.seq != seq || record.sent != sent)
+    {
+      return false;
+    }
+  record.pending = false;
+  return true;
+}
 
-void 
-UdpMultipathRouter::ScheduleTransmit (Time dt, uint32_t p, Ptr<Socket> s, Address addr, uint16_t port)
-{ 
-  NS_LOG_FUNCTION (this << dt);
-  m_sendEvent = Simulator::Schedule (dt, &UdpMultipathRouter::Send, this, p, s, addr, port);
+bool
+UdpMultipathRouter::IsProbing (void) const
+{
+  return delayProbing || balancingAlgorithm == BalancingAlgorithm::LOWEST_DELAY
+         || balancingAlgorithm == BalancingAlgorithm::DELAY_CAPACITY;
 }
 
 void
-UdpMultipathRouter::CreatePath ( Address source_ip, uint16_t source_port, Address dest_ip, uint16_t dest_port,
-                                  uint32_t node_id, uint32_t channel_id )
+UdpMultipathRouter::HandleReport (Ptr<Socket> socket)
 {
-  UdpMultipathRouter::CheckIpv4(source_ip, source_port);
+  NS_LOG_FUNCTION (this << socket);
+  Ptr<Packet> packet;
+  Address from;
+  while ((packet = socket->RecvFrom (from)))
+    {
+      // Deserialize trusts the entry count, so check it against the size first
+      uint8_t count[2];
+      if (packet->CopyData (count, 2) < 2
+          || packet->GetSize () < UdpMultipathReportHeader::GetReportSize ((count[0] << 8) | count[1]))
+        {
+          NS_LOG_LOGIC ("Truncated report of " << packet->GetSize () << " bytes dropped");
+          continue;
+        }
+      UdpMultipathReportHeader report;
+      packet->RemoveHeader (report);
+      std::vector<UdpMultipathReportEntry>::const_iterator it;
+      for (it = report.GetEntries ().begin (); it != report.GetEntries ().end (); ++it)
+        {
+          uint32_t index = channelTable.GetChannelIndex ((*it).channel_id);
+          if (index == ChannelTable::INVALID_INDEX)
+            {
+              NS_LOG_LOGIC ("Report for unknown channel " << (*it).channel_id);
+              continue;
+            }
+          channelTable.UpdateDeliveryAt (index, (*it).delivered_packets, (*it).delivered_bytes,
+                                         (*it).lost_packets);
+          if ((*it).probe_sent != 0 && UdpMultipathRouter::MatchProbe ((*it).probe_seq, TimeStep ((*it).probe_sent)))
+            {
+              // a sink does not echo: the probe comes back in the report, minus the time it held it
+              Time rtt = Simulator::Now () - TimeStep ((*it).probe_sent) - NanoSeconds ((*it).probe_hold);
+              if (rtt.IsPositive ())
+                {
+                  channelTable.UpdateChannelDelayAt (index, rtt);
+                }
+            }
+          NS_LOG_LOGIC ("Report for channel " << (*it).channel_id
+                        << " loss ratio " << channelTable.GetChannelLossRatioAt (index)
+                        << " delivery rate " << channelTable.GetChannelDeliveryRateAt (index));
+        }
+    }
+}
+
+void
+UdpMultipathRouter::RoutePacket (Ptr<Packet> packet, FlowIndexEntry *flow, uint64_t flow_hash)
+{
+      HOT_PATH_LOGIC("Routing packet to destination... ");
+      UdpMultipathHeader tag;
+      bool transit = false;
+      if (flow == 0 && pathTags) {
+        // Not one of our sources: an upstream router tagged it with its destination
+        if (packet->GetSize () < tag.GetSerializedSize ()) {
+          HOT_PATH_LOGIC("Untagged packet from unknown source dropped");
+          UdpMultipathRouter::DropPacket (packet, DropReason::NO_ROUTE, ChannelTable::INVALID_INDEX);
+          return;
+        }
+        packet->RemoveHeader (tag);
+        if (!tag.IsValid ()) {
+          HOT_PATH_LOGIC("Untagged packet from unknown source dropped");
+          UdpMultipathRouter::DropPacket (packet, DropReason::NO_ROUTE, ChannelTable::INVALID_INDEX);
+          return;
+        }
+        if (tag.GetHopCount () == 0 || tag.GetHopCount () >= MAX_HOP_COUNT) {
+          HOT_PATH_LOGIC("Dropped packet with hop count " << tag.GetHopCount ());
+          UdpMultipathRouter::DropPacket (packet, DropReason::HOP_LIMIT, ChannelTable::INVALID_INDEX);
+          return;
+        }
+        flow = flowIndex.LookupNode( tag.GetNodeId () );
+        if (flow == 0) {
+          HOT_PATH_LOGIC("Dropped tagged packet for unknown node " << tag.GetNodeId ());
+          UdpMultipathRouter::DropPacket (packet, DropReason::NO_ROUTE, ChannelTable::INVALID_INDEX);
+          return;
+        }
+        // the flow id set by the first router keeps the flow on one affinity bucket
+        flow_hash = ( static_cast<uint64_t> (tag.GetFlowId ()) << 32 ) | tag.GetNodeId ();
+        transit = true;
+      }
+      if (flow == 0) {
+        // no path entry for this source and port, and no tags to route by
+        HOT_PATH_LOGIC("Dropped packet from unknown source");
+        UdpMultipathRouter::DropPacket (packet, DropReason::NO_ROUTE, ChannelTable::INVALID_INDEX);
+        return;
+      }
+      if (flow->candidates.empty ()) {
+        // every next hop towards the node was removed
+        HOT_PATH_LOGIC("No channel left to node " << flow->node_id);
+        UdpMultipathRouter::DropPacket (packet, DropReason::NO_ROUTE, ChannelTable::INVALID_INDEX);
+        return;
+      }
+      HOT_PATH_LOGIC("Found node ID: " << flow->node_id);
+      HOT_PATH_LOGIC("Found " << flow->candidates.size() << " available channels ");
+      NodeTableEntry *chosenPath = nodeTable.ChooseBestPath( flow->candidates,
+                                                             UdpMultipathRouter::balancingAlgorithm,
+                                                             channelTable, flow_hash );
+      m_routeTrace (packet, flow->node_id, chosenPath->channel_id);
+      NodeTableEntry *sparePath = chosenPath;
+      // redundancy is added once, by the first router of the chain
+      if (redundancyMode != RedundancyMode::NONE && !transit) {
+        sparePath = nodeTable.ChooseSparePath( flow->candidates, chosenPath, channelTable );
+      }
+      Ptr<Packet> parity = 0;
+      if (transit) {
+        // keep flow id, sequence and FEC fields; Send rewrites the channel fields
+        tag.SetHopCount( tag.GetHopCount () + 1 );
+        packet->AddHeader (tag);
+      } else if (multipathHeader) {
+        // flow fields are set once here, so duplicates share them; Send fills in the channel
+        UdpMultipathHeader header;
+        header.SetFlowId( flow->flow_id );
+        header.SetFlowSeq( flow->next_seq++ );
+        header.SetNodeId( flow->node_id );
+        header.SetHopCount( 1 );
+        if (redundancyMode == RedundancyMode::XOR_PARITY) {
+          header.SetFecGroupSize( fecGroupSize );
+          header.SetFecIndex( flow->fec_count );
+          parity = UdpMultipathRouter::AddParity (packet, flow);
+        }
+        packet->AddHeader (header);
+      }
+      HOT_PATH_LOGIC (
+                    "At time " << Simulator::Now ().GetSeconds () << " routing of packet (" << packet->GetSize ()
+                    << " bytes) for node " << flow->node_id
+                    << " to "  << Ipv4Address::ConvertFrom (chosenPath->dest_addr) 
+                    << " port: " << chosenPath->dest_port
+                   );
+      // the copy is taken before Send rewrites the packet
+      Ptr<Packet> duplicate = 0;
+      if (redundancyMode == RedundancyMode::DUPLICATE && sparePath != chosenPath && !transit) {
+        duplicate = packet->Copy ();
+      }
+      UdpMultipathRouter::Egress (packet, chosenPath);
+      if (duplicate != 0) {
+        UdpMultipathRouter::Egress (duplicate, sparePath);
+      }
+      if (parity != 0) {
+        // after the packet closing the group, so the parity cannot overtake it on a shared channel
+        HOT_PATH_LOGIC ("Sending parity of flow " << flow->flow_id << " on channel " << sparePath->channel_id);
+        UdpMultipathRouter::Egress (parity, sparePath);
+      }
+}
+
+// Packet loss mechanism, applied to every packet leaving on a channel
+// (data, duplicates and parity alike), then forwarding
+void
+UdpMultipathRouter::Egress (Ptr<Packet> packet, NodeTableEntry *path)
+{
+      uint32_t packet_size = packet->GetSize ();
+      bool drop = false;
+      Time delay = Seconds (0);
+      switch (UdpMultipathRouter::dropMode) {
+        case DropMode::NO_DROPPING: {
+          break;
+        }
+        case DropMode::TX_RATE: {
+          uint64_t available_capacity = channelTable.GetChannelAvailableCapacityAt(path->channel_index);
+          HOT_PATH_LOGIC (" Available capacity: " << available_capacity);
+          drop = available_capacity == 0;
+          break;
+        }
+        case DropMode::TX_DROP_THRESHOLD: {
+          uint64_t available_bytes = channelTable.GetAvailableBytesAt(path->channel_index);
+          HOT_PATH_LOGIC (" Available bytes : " << available_bytes);
+          drop = available_bytes < packet_size;
+          break;
+        }
+        case DropMode::TOKEN_BUCKET: {
+          if (shaperQueueing) {
+            drop = !channelTable.ReserveTokensAt(path->channel_index, packet_size, delay);
+          } else {
+            drop = !channelTable.ConsumeTokensAt(path->channel_index, packet_size);
+          }
+          HOT_PATH_LOGIC (" Token bucket delay: " << delay);
+          break;
+        }
+        default:
+          NS_ASSERT_MSG (false, "Invalid drop mode" );
+      }
+      
+      if (drop) {
+        // Dropped Packet
+        HOT_PATH_LOGIC("Dropped packet... " << path->channel_id);
+        UdpMultipathRouter::DropPacket (packet, DropReason::POLICER, path->channel_index);
+      } else {
+        HOT_PATH_LOGIC("Picked channel... " << path->channel_id);
+        UdpMultipathRouter::Forward (packet, path, delay);
+      }
+}
+
+void
+UdpMultipathRouter::Forward (Ptr<Packet> packet, NodeTableEntry *path, Time delay)
+{
+  if (queueDepth > 0)
+    {
+      // the egress queue paces at channel capacity, no extra shaping delay needed
+      UdpMultipathRouter::Enqueue (packet, path);
+    }
+  else if (delay.IsStrictlyPositive ())
+    {
+      UdpMultipathRouter::ScheduleTransmit (delay, packet, path);
+    }
+  else
+    {
+      UdpMultipathRouter::Send (packet, path);
+    }
+}
+
+// XOR the payload into the flow's FEC group; the k-th packet closes the group
+// and gets back the parity packet, for the spare channel
+Ptr<Packet>
+UdpMultipathRouter::AddParity (Ptr<Packet> packet, FlowIndexEntry *flow)
+{
+  // parity covers exactly what the sink gets: the payload without the
+  // probe (Send adds it later and the sink strips it), zeros with NEW_PACKET
+  uint32_t size = packet->GetSize ();
+  if (flow->fec_parity.size () < size)
+    {
+      flow->fec_parity.resize (size, 0);
+    }
+  if (forwardingMode == ForwardingMode::ZERO_COPY && size > 0)
+    {
+      if (m_fecScratch.size () < size)
+        {
+          m_fecScratch.resize (size);
+        }
+      packet->CopyData (&m_fecScratch[0], size);
+      for (uint32_t i = 0; i < size; i++)
+        {
+          flow->fec_parity[i] ^= m_fecScratch[i];
+        }
+    }
+  flow->fec_length ^= size;
+  flow->fec_count++;
+  if (flow->fec_count < fecGroupSize)
+    {
+      return 0;
+    }
+  Ptr<Packet> parity = flow->fec_parity.empty () ? Create<Packet> ()
+    : Create<Packet> (&flow->fec_parity[0], flow->fec_parity.size ());
+  UdpMultipathHeader header;
+  header.SetFlags (UdpMultipathHeader::FLAG_PARITY);
+  header.SetFlowId (flow->flow_id);
+  header.SetFlowSeq (flow->next_seq - fecGroupSize); // first packet of the group
+  header.SetFecGroupSize (fecGroupSize);
+  header.SetFecLength (flow->fec_length);
+  header.SetNodeId (flow->node_id);
+  header.SetHopCount (1);
+  parity->AddHeader (header);
+  flow->fec_parity.clear ();
+  flow->fec_length = 0;
+  flow->fec_count = 0;
+  return parity;
+}
+
+
+void 
+UdpMultipathRouter::ScheduleTransmit (Time dt, Ptr<Packet> p, NodeTableEntry *path)
+{ 
+  NS_LOG_FUNCTION (this << dt);
+  // sends mostly expire in order, so pruning the front keeps the list short
+  while (!m_sendEvents.empty () && m_sendEvents.front ().IsExpired ())
+    {
+      m_sendEvents.pop_front ();
+    }
+  m_sendEvents.push_back (Simulator::Schedule (dt, &UdpMultipathRouter::SendScheduled, this, p, path));
+}
+
+// Delayed sends run outside of a HandleRead batch: refresh before counting
+void
+UdpMultipathRouter::SendScheduled (Ptr<Packet> packet, NodeTableEntry *path)
+{
+  channelTable.UpdateChannelsCurrentUse ( );
+  UdpMultipathRouter::Send (packet, path);
+}
+
+void
+UdpMultipathRouter::CancelPendingSends (void)
+{
+  std::deque<EventId>::iterator it;
+  for (it = m_sendEvents.begin (); it != m_sendEvents.end (); ++it)
+    {
+      Simulator::Cancel (*it);
+    }
+  m_sendEvents.clear ();
+}
+
+void
+UdpMultipathRouter::Enqueue (Ptr<Packet> packet, NodeTableEntry *path)
+{
+  EgressQueue &queue = egressQueues[path->channel_index];
+  uint64_t old_length = queue.items.size ();
+  bool early_drop = false;
+  switch (queueDiscipline) {
+    case QueueDiscipline::RED: {
+      early_drop = queue.RedDrop (queueDepth, m_aqmRandom->GetValue ());
+      break;
+    }
+    case QueueDiscipline::PIE: {
+      early_drop = queue.PieDrop (channelTable.GetChannelCapacityAt (path->channel_index),
+                                  m_aqmRandom->GetValue (), Simulator::Now ());
+      break;
+    }
+    default:
+      break;
+  }
+  if (early_drop)
+    {
+      HOT_PATH_LOGIC ("AQM early drop... " << path->channel_id);
+      UdpMultipathRouter::DropPacket (packet, DropReason::AQM, path->channel_index);
+      return;
+    }
+  if (queue.items.size () >= queueDepth)
+    {
+      if (queueDropPolicy == QueueDropPolicy::DROP_TAIL)
+        {
+          HOT_PATH_LOGIC ("Egress queue full, dropped packet... " << path->channel_id);
+          UdpMultipathRouter::DropPacket (packet, DropReason::QUEUE_OVERFLOW, path->channel_index);
+          return;
+        }
+      EgressQueueItem &head = queue.items.front ();
+      HOT_PATH_LOGIC ("Egress queue full, dropped head packet... " << path->channel_id);
+      UdpMultipathRouter::DropPacket (head.packet, DropReason::QUEUE_OVERFLOW, path->channel_index);
+      queue.bytes -= head.packet->GetSize ();
+      queue.items.pop_front ();
+    }
+  queue.items.push_back (EgressQueueItem (packet, path));
+  queue.bytes += packet->GetSize ();
+  UdpMultipathRouter::NotifyQueueLength (path->channel_index, old_length);
+  if (!queue.drain_event.IsRunning ())
+    {
+      ScheduleDrain (path->channel_index);
+    }
+}
+
+void
+UdpMultipathRouter::ScheduleDrain (uint32_t channel_index)
+{
+  EgressQueue &queue = egressQueues[channel_index];
+  Time now = Simulator::Now ();
+  Time dt = queue.next_transmit > now ? queue.next_transmit - now : Seconds (0);
+  queue.drain_event = Simulator::Schedule (dt, &UdpMultipathRouter::DrainQueue, this, channel_index);
+}
+
+void
+UdpMultipathRouter::DrainQueue (uint32_t channel_index)
+{
+  EgressQueue &queue = egressQueues[channel_index];
+  if (queue.items.empty ())
+    {
+      return;
+    }
+  // sends and CoDel drops below count into the interval open now
+  channelTable.UpdateChannelsCurrentUse ( );
+  uint64_t old_length = queue.items.size ();
+  EgressQueueItem item = queue.items.front ();
+  queue.items.pop_front ();
+  queue.bytes -= item.packet->GetSize ();
+  if (queueDiscipline == QueueDiscipline::CODEL)
+    {
+      while (queue.CodelDrop (item, Simulator::Now ()))
+        {
+          HOT_PATH_LOGIC ("CoDel drop... " << item.path->channel_id);
+          UdpMultipathRouter::DropPacket (item.packet, DropReason::AQM, channel_index);
+          if (queue.items.empty ())
+            {
+              UdpMultipathRouter::NotifyQueueLength (channel_index, old_length);
+              return;
+            }
+          item = queue.items.front ();
+          queue.items.pop_front ();
+          queue.bytes -= item.packet->GetSize ();
+        }
+    }
+  // channel stays busy for the serialization time of this packet
+  queue.next_transmit = Simulator::Now ()
+    + Seconds (item.packet->GetSize () * 8.0 / channelTable.GetChannelCapacityAt (channel_index));
+  UdpMultipathRouter::NotifyQueueLength (channel_index, old_length);
+  UdpMultipathRouter::Send (item.packet, item.path);
+  if (!queue.items.empty ())
+    {
+      ScheduleDrain (channel_index);
+    }
+}
+
+void
+UdpMultipathRouter::FlushQueues (void)
+{
+  for (uint32_t i = 0; i < egressQueues.size (); i++)
+    {
+      uint64_t old_length = egressQueues[i].items.size ();
+      Simulator::Cancel (egressQueues[i].drain_event);
+      egressQueues[i].items.clear ();
+      egressQueues[i].bytes = 0;
+      if (old_length > 0)
+        {
+          UdpMultipathRouter::NotifyQueueLength (i, old_length);
+        }
+    }
+}
+
+void
+UdpMultipathRouter::DropPacket (Ptr<const Packet> packet, DropReason reason, uint32_t channel_index)
+{
+  uint32_t channel_id = ChannelTable::NO_CHANNEL_ID;
+  if (channel_index != ChannelTable::INVALID_INDEX)
+    {
+      channelTable.AddDroppedPacketAt (channel_index, packet->GetSize ());
+      channel_id = channelTable.GetChannelId (channel_index);
+    }
+  m_dropTrace (packet, reason, channel_id);
+}
+
+void
+UdpMultipathRouter::NotifyQueueLength (uint32_t channel_index, uint64_t old_length)
+{
+  uint64_t length = egressQueues[channel_index].items.size ();
+  if (length != old_length)
+    {
+      m_queueLengthTrace (channelTable.GetChannelId (channel_index), old_length, length);
+    }
+}
+
+void
+UdpMultipathRouter::NotifyChannelRate (uint32_t channel_id, Time interval_end, uint64_t old_rate, uint64_t new_rate)
+{
+  m_channelRateTrace (channel_id, interval_end, old_rate, new_rate);
+}
+
+void
+UdpMultipathRouter::CreatePath ( Address source_ip, uint16_t source_port, Address dest_ip, uint16_t dest_port,
+                                  uint32_t node_id, uint32_t channel_id )
+{
+  UdpMultipathRouter::CheckIpv4(source_ip, source_port);
   UdpMultipathRouter::CheckIpv4(dest_ip, dest_port);
   nodeTable.AddNodeEntry(node_id, dest_ip, dest_port, 0, channel_id); // null socket
   pathTable.AddPathTableEntry(source_ip, source_port, node_id, 0); // null socket
+  if (running)
+    {
+      UdpMultipathRouter::OpenNextHop( &nodeTable.entries.back () );
+      UdpMultipathRouter::OpenPath( pathTable.entries.back () );
+    }
+  else
+    {
+      flowIndex.Invalidate();
+    }
+}
+
+void
+UdpMultipathRouter::CreateNextHop ( Address dest_ip, uint16_t dest_port, uint32_t node_id, uint32_t channel_id )
+{
+  UdpMultipathRouter::CheckIpv4(dest_ip, dest_port);
+  nodeTable.AddNodeEntry(node_id, dest_ip, dest_port, 0, channel_id); // null socket
+  if (running)
+    {
+      UdpMultipathRouter::OpenNextHop( &nodeTable.entries.back () );
+    }
+  else
+    {
+      flowIndex.Invalidate();
+    }
+}
+
+void
+UdpMultipathRouter::AddChannels ( std::string channels )
+{
+  std::istringstream list (channels);
+  std::string entry;
+  while (std::getline (list, entry, ';'))
+    {
+      if (entry.find_first_not_of (" \t") == std::string::npos)
+        {
+          continue;
+        }
+      std::istringstream fields (entry);
+      UdpMultipathRouter::AddChannelFields (fields, "channel \"" + entry + "\"");
+    }
+}
+
+void
+UdpMultipathRouter::AddPaths ( std::string paths )
+{
+  std::istringstream list (paths);
+  std::string entry;
+  while (std::getline (list, entry, ';'))
+    {
+      if (entry.find_first_not_of (" \t") == std::string::npos)
+        {
+          continue;
+        }
+      std::istringstream fields (entry);
+      UdpMultipathRouter::AddPathFields (fields, "path \"" + entry + "\"");
+    }
+}
+
+// where names the entry in error messages
+void
+UdpMultipathRouter::AddChannelFields ( std::istream &fields, const std::string &where )
+{
+  uint32_t channel_id;
+  uint32_t capacity;
+  std::string rest;
+  if (!(fields >> channel_id >> capacity) || (fields >> rest))
+    {
+      NS_FATAL_ERROR ("Invalid " << where << ", expected <channel id> <capacity Mbps>");
+    }
+  if (channelTable.GetChannelIndex( channel_id ) != ChannelTable::INVALID_INDEX)
+    {
+      NS_FATAL_ERROR ("Invalid " << where << ", channel " << channel_id << " already exists");
+    }
+  if (capacity == 0)
+    {
+      NS_FATAL_ERROR ("Invalid " << where << ", channel " << channel_id << " has no capacity");
+    }
+  channelTable.AddChannelEntry( channel_id, capacity );
+}
+
+void
+UdpMultipathRouter::AddPathFields ( std::istream &fields, const std::string &where )
+{
+  std::string source;
+  std::string next_hop;
+  uint16_t source_port;
+  uint16_t next_hop_port;
+  uint32_t node_id;
+  uint32_t channel_id;
+  std::string rest;
+  if (!(fields >> source >> source_port >> next_hop >> next_hop_port >> node_id >> channel_id)
+      || (fields >> rest))
+    {
+      NS_FATAL_ERROR ("Invalid " << where << ", expected <source address> <source port> "
+                      "<next hop address> <next hop port> <node id> <channel id>");
+    }
+  UdpMultipathRouter::CreatePath( Ipv4Address (source.c_str ()), source_port,
+                                  Ipv4Address (next_hop.c_str ()), next_hop_port, node_id, channel_id );
+}
+
+void
+UdpMultipathRouter::SetTablesFile ( std::string path )
+{
+  m_tablesFile = path;
+}
+
+// The file is read once, straight into the tables; the references between
+// them are checked after the whole file is in, so entries may come in any
+// order. The flow index is then built from the tables as usual.
+void
+UdpMultipathRouter::LoadTablesFile ( )
+{
+  NS_LOG_FUNCTION (this << m_tablesFile);
+  std::ifstream file (m_tablesFile.c_str ());
+  if (!file.is_open ())
+    {
+      NS_FATAL_ERROR ("Could not open tables file " << m_tablesFile);
+    }
+  std::string line;
+  uint32_t line_number = 0;
+  uint32_t loaded = 0;
+  while (std::getline (file, line))
+    {
+      line_number++;
+      std::string::size_type comment = line.find ('#');
+      if (comment != std::string::npos)
+        {
+          line.erase (comment);
+        }
+      std::istringstream fields (line);
+      std::string kind;
+      if (!(fields >> kind))
+        {
+          continue;
+        }
+      std::ostringstream where;
+      where << m_tablesFile << ":" << line_number << " (" << kind << ")";
+      if (kind == "channel")
+        {
+          UdpMultipathRouter::AddChannelFields (fields, where.str ());
+        }
+      else if (kind == "path")
+        {
+          UdpMultipathRouter::AddPathFields (fields, where.str ());
+        }
+      else if (kind == "nexthop")
+        {
+          std::string next_hop;
+          uint16_t next_hop_port;
+          uint32_t node_id;
+          uint32_t channel_id;
+          std::string rest;
+          if (!(fields >> next_hop >> next_hop_port >> node_id >> channel_id) || (fields >> rest))
+            {
+              NS_FATAL_ERROR ("Invalid " << where.str () << ", expected <next hop address> <next hop port> "
+                              "<node id> <channel id>");
+            }
+          UdpMultipathRouter::CreateNextHop( Ipv4Address (next_hop.c_str ()), next_hop_port, node_id, channel_id );
+        }
+      else if (kind == "transit")
+        {
+          uint16_t listen_port;
+          std::string rest;
+          if (!(fields >> listen_port) || (fields >> rest))
+            {
+              NS_FATAL_ERROR ("Invalid " << where.str () << ", expected <listen port>");
+            }
+          UdpMultipathRouter::AddTransitPort( listen_port );
+        }
+      else
+        {
+          NS_FATAL_ERROR ("Invalid " << where.str () << ", unknown entry type");
+        }
+      loaded++;
+    }
+  std::list<NodeTableEntry>::const_iterator it;
+  for (it = nodeTable.entries.begin (); it != nodeTable.entries.end (); ++it)
+    {
+      if (channelTable.GetChannelIndex( (*it).channel_id ) == ChannelTable::INVALID_INDEX)
+        {
+          NS_FATAL_ERROR (m_tablesFile << ": node " << (*it).node_id << " is reached over channel "
+                          << (*it).channel_id << ", which is not declared");
+        }
+    }
+  NS_LOG_INFO ("Loaded " << loaded << " table entries from " << m_tablesFile);
+}
+
+void
+UdpMultipathRouter::AddTransitPort ( uint16_t listen_port )
+{
+  // any source, no destination: the path tag of each packet names it
+  pathTable.AddPathTableEntry(Ipv4Address::GetAny (), listen_port, NODE_ERROR, 0); // null socket
+  if (running)
+    {
+      UdpMultipathRouter::OpenPath( pathTable.entries.back () );
+    }
+  else
+    {
+      flowIndex.Invalidate();
+    }
+}
+
+void
+UdpMultipathRouter::AddChannel ( uint32_t channel_id, uint32_t capacity )
+{
+  channelTable.AddChannelEntry( channel_id, capacity );
+  egressQueues.resize( channelTable.GetChannelCount () );
+}
+
+void
+UdpMultipathRouter::RemoveChannel ( uint32_t channel_id )
+{
+  uint32_t index = channelTable.GetChannelIndex( channel_id );
+  NS_ASSERT_MSG (index != ChannelTable::INVALID_INDEX, "Channel " << channel_id << " does not exist");
+  std::vector<NodeTableEntry *> next_hops;
+  std::list<NodeTableEntry>::iterator it;
+  for (it = nodeTable.entries.begin (); it != nodeTable.entries.end (); ++it)
+    {
+      if ((*it).channel_id == channel_id)
+        {
+          next_hops.push_back (&(*it));
+        }
+    }
+  for (uint32_t i = 0; i < next_hops.size (); i++)
+    {
+      UdpMultipathRouter::CloseNextHop( next_hops[i] );
+    }
+  if (index < egressQueues.size ())
+    {
+      EgressQueue &queue = egressQueues[index];
+      uint64_t old_length = queue.items.size ();
+      Simulator::Cancel (queue.drain_event);
+      while (!queue.items.empty ())
+        {
+          UdpMultipathRouter::DropPacket (queue.items.front ().packet, DropReason::NO_ROUTE, index);
+          queue.items.pop_front ();
+        }
+      queue.bytes = 0;
+      if (old_length > 0)
+        {
+          UdpMultipathRouter::NotifyQueueLength (index, old_length);
+        }
+    }
+  channelTable.RemoveChannelEntry( channel_id );
+}
+
+void
+UdpMultipathRouter::SetChannelCapacity ( uint32_t channel_id, uint32_t capacity )
+{
+  channelTable.SetChannelCapacity( channel_id, capacity );
+}
+
+void
+UdpMultipathRouter::RemovePath ( Address source_ip, uint16_t source_port )
+{
+  std::list<PathTableEntry>::iterator it = pathTable.entries.begin ();
+  bool found = false;
+  while (it != pathTable.entries.end ())
+    {
+      if ((*it).src_port != source_port || !((*it).src_addr == source_ip))
+        {
+          ++it;
+          continue;
+        }
+      found = true;
+      // the receiving socket is shared by every path on the port
+      bool shared = false;
+      std::list<PathTableEntry>::const_iterator other;
+      for (other = pathTable.entries.begin (); other != pathTable.entries.end (); ++other)
+        {
+          shared = shared || (other != it && (*it).src_socket != 0 && (*other).src_socket == (*it).src_socket);
+        }
+      if (!shared)
+        {
+          UdpMultipathRouter::closeReceivingSocket( (*it).src_socket );
+        }
+      if (flowIndex.IsValid ())
+        {
+          flowIndex.RemovePath( *it, !shared );
+        }
+      it = pathTable.entries.erase (it);
+    }
+  NS_ASSERT_MSG (found, "No path from " << source_ip << " port " << source_port);
+}
+
+void
+UdpMultipathRouter::RemoveNextHop ( Address dest_ip, uint16_t dest_port, uint32_t node_id, uint32_t channel_id )
+{
+  NodeTableEntry *entry = nodeTable.FindNodeEntry( dest_ip, dest_port, node_id, channel_id );
+  NS_ASSERT_MSG (entry != 0, "No next hop " << dest_ip << " port " << dest_port << " for node " << node_id
+                 << " on channel " << channel_id);
+  UdpMultipathRouter::CloseNextHop( entry );
+}
+
+// Sockets of an entry added while running; the index learns about it in place
+void
+UdpMultipathRouter::OpenPath ( PathTableEntry &entry )
+{
+  std::list<PathTableEntry>::const_iterator it;
+  for (it = pathTable.entries.begin (); it != pathTable.entries.end (); ++it)
+    {
+      if (&(*it) != &entry && (*it).src_port == entry.src_port && (*it).src_socket != 0)
+        {
+          entry.src_socket = (*it).src_socket;
+          break;
+        }
+    }
+  entry.src_socket = UdpMultipathRouter::initReceivingSocket( entry.src_socket, entry.src_port );
+  if (flowIndex.IsValid ())
+    {
+      flowIndex.AddPath( entry );
+    }
+}
+
+void
+UdpMultipathRouter::OpenNextHop ( NodeTableEntry *entry )
+{
+  entry->channel_index = channelTable.GetChannelIndex( entry->channel_id );
+  NS_ASSERT_MSG (entry->channel_index != ChannelTable::INVALID_INDEX,
+                 "Path uses unknown channel id " << entry->channel_id);
+  entry->dest_socket = UdpMultipathRouter::initSendingSocket( entry->dest_socket, entry->dest_port, entry->dest_addr );
+  entry->dest_socket->GetSockName ( entry->local_addr );
+  entry->remote_addr = InetSocketAddress ( Ipv4Address::ConvertFrom (entry->dest_addr), entry->dest_port );
+  if (flowIndex.IsValid ())
+    {
+      flowIndex.AddNextHop( entry );
+    }
+}
+
+// The entry is retired rather than freed: queued and scheduled packets may
+// still point to it, and Send drops them once its socket is gone
+void
+UdpMultipathRouter::CloseNextHop ( NodeTableEntry *entry )
+{
+  if (flowIndex.IsValid ())
+    {
+      flowIndex.RemoveNextHop( entry );
+    }
+  if (entry->dest_socket != 0)
+    {
+      entry->dest_socket->Close ();
+      entry->dest_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
+      entry->dest_socket = 0;
+    }
+  nodeTable.RetireNodeEntry( entry );
 }
 
 void 
-UdpMultipathRouter::Send (uint32_t packet_size, Ptr<Socket> socket, Address dest_addr, uint16_t dest_port)
+UdpMultipathRouter::Send (Ptr<Packet> packet, NodeTableEntry *path)
 {
-  Ptr<Packet> packet = Create<Packet>(packet_size);
-  // TODO: Find correct channel for this socket
-  uint32_t channel_id = nodeTable.FindSocketChannel( socket );
-  if (channel_id == NODE_ERROR) {
-    NS_ASSERT_MSG (false, "Router could not find channel id for sending socket!!");
-  }
-  channelTable.UpdateChannelByteCounter(channel_id, packet_size / 1024);
-  NS_LOG_FUNCTION (this);
-  CheckIpv4(dest_addr, dest_port);
-  Address localAddress;
-  socket->GetSockName (localAddress);
-  // TODO: check what packet tags are about in the docs
- // m_txTrace (packet);
-  if (Ipv4Address::IsMatchingType (dest_addr))
+  if (path->dest_socket == 0)
+    {
+      // next hop removed while the packet was queued or delayed
+      UdpMultipathRouter::DropPacket (packet, DropReason::NO_ROUTE, path->channel_index);
+      return;
+    }
+  UdpMultipathHeader header;
+  if (multipathHeader)
+    {
+      packet->RemoveHeader (header);
+      if (header.HasProbe ())
+        {
+          // probe of an upstream router, each hop carries only its own
+          SeqTsHeader upstream;
+          packet->RemoveHeader (upstream);
+          header.SetFlags (header.GetFlags () & ~UdpMultipathHeader::FLAG_PROBE);
+        }
+    }
+  uint32_t packet_size = packet->GetSize ();
+  if (forwardingMode == ForwardingMode::NEW_PACKET)
+    {
+      packet = Create<Packet>(packet_size);
+    }
+  if (UdpMultipathRouter::IsProbing ())
+    {
+      // timestamp is echoed back by the receiver and read in HandleEcho
+      SeqTsHeader probe;
+      probe.SetSeq (probeSeq++);
+      ProbeRecord &record = m_probes[probe.GetSeq () % PROBE_WINDOW];
+      record.seq = probe.GetSeq ();
+      record.sent = probe.GetTs ();
+      record.pending = true;
+      packet->AddHeader (probe);
+      packet_size = packet->GetSize ();
+      // the sink strips it again, so FEC and the application see the payload only
+      header.SetFlags (header.GetFlags () | UdpMultipathHeader::FLAG_PROBE);
+    }
+  if (multipathHeader)
     {
-  //    m_txTraceWithAddresses (packet, localAddress, InetSocketAddress (Ipv4Address::ConvertFrom (dest_addr), dest_port));
-    socket->Send (packet);
-    NS_LOG_LOGIC ("At time " << Simulator::Now ().GetSeconds () << "s router sent " << packet_size << " bytes to " << Ipv4Address::ConvertFrom (dest_addr) << " port " << dest_port);
+      header.SetChannelId (path->channel_id);
+      // numbered per next hop: a sink only sees the packets sent to it
+      header.SetChannelSeq (path->tx_sequence++);
+      packet->AddHeader (header);
+      packet_size = packet->GetSize ();
     }
+  // addresses were checked by CreatePath, nothing to convert per packet
+  channelTable.UpdateChannelByteCounterAt(path->channel_index, packet_size);
+  m_txTrace (packet);
+  m_txTraceWithAddresses (packet, path->local_addr, path->remote_addr);
+  path->dest_socket->Send (packet);
+  HOT_PATH_LOGIC ("At time " << Simulator::Now ().GetSeconds () << "s router sent " << packet_size
+                  << " bytes to " << Ipv4Address::ConvertFrom (path->dest_addr) << " port " << path->dest_port);
 }
 
 void
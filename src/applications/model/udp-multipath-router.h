@@ -24,50 +24,189 @@
 #include "ns3/ptr.h"
 #include "ns3/address.h"
 #include "ns3/traced-callback.h"
+#include "ns3/callback.h"
 #include "ns3/nstime.h"
+#include "ns3/ipv4-address.h"
+#include "udp-multipath-stats.h"
 #include <list>
+#include <vector>
+#include <deque>
+#include <istream>
 #include <iterator>
+#include <unordered_map>
 
 namespace ns3 {
 
 class Socket;
 class Packet;
 class Time;
+class UniformRandomVariable;
 
-enum class BalancingAlgorithm { NO_BALANCING, TX_RATE, TX_DROP_THRESHOLD };
-enum class DropMode { NO_DROPPING, TX_RATE, TX_DROP_THRESHOLD };
+// WEIGHTED_ROUND_ROBIN splits packets across the candidates in proportion
+// to their channel capacity (smooth weighted round-robin)
+// FLOW_AFFINITY pins each source flow to one channel (rendezvous hashing) and
+// only moves it when that channel goes over the affinity threshold
+// LOWEST_DELAY picks the channel with the lowest measured delay
+// DELAY_CAPACITY picks the lowest delay + serialization time at the spare capacity
+// (both turn on delay probing, see SetDelayProbing)
+// DELIVERY_RATE picks the most capacity left after the loss reported by the
+// receivers, capped by their delivery rate once a channel loses packets
+// (needs UdpMultipathSink reports, see SetReceiverReports)
+// PERCENTILE_RATE is TX_RATE against the larger of the current use and the
+// 95th percentile of the channel history, so bursty channels are avoided
+enum class BalancingAlgorithm { NO_BALANCING, TX_RATE, TX_DROP_THRESHOLD, WEIGHTED_ROUND_ROBIN,
+                                FLOW_AFFINITY, LOWEST_DELAY, DELAY_CAPACITY, DELIVERY_RATE,
+                                PERCENTILE_RATE };
+// TOKEN_BUCKET polices (or, with shaper queueing, shapes) every channel with a
+// token bucket filled at channel capacity, so egress never exceeds it
+enum class DropMode { NO_DROPPING, TX_RATE, TX_DROP_THRESHOLD, TOKEN_BUCKET };
+// How ChannelTable turns per-interval byte counters into current_use
+// LAST_INTERVAL: raw rate of the last refresh interval
+// EWMA: exponentially weighted moving average (alpha = weight of the newest sample)
+// SLIDING_WINDOW: mean rate over the last N refresh intervals
+enum class RateEstimator { LAST_INTERVAL, EWMA, SLIDING_WINDOW };
+// What a full egress queue discards: the arriving packet or the oldest one
+enum class QueueDropPolicy { DROP_TAIL, DROP_HEAD };
+// Active queue management on the egress queues, on top of the drop policy
+// RED: random early drop on the average queue length (enqueue)
+// CODEL: drops when the sojourn time stays above target for an interval (dequeue)
+// PIE: drop probability driven by the estimated queueing delay (enqueue)
+enum class QueueDiscipline { FIFO, RED, CODEL, PIE };
+// Spend spare bandwidth against loss (needs the multipath header and a UdpMultipathSink)
+// DUPLICATE sends every packet on the chosen channel and a copy on a spare one
+// XOR_PARITY sends one XOR parity packet per FEC group over a spare channel
+enum class RedundancyMode { NONE, DUPLICATE, XOR_PARITY };
+// Why the router discarded a packet, reported by the Drop trace source
+// POLICER: drop mode (rate, threshold or token bucket), QUEUE_OVERFLOW: egress queue full,
+// AQM: RED, CoDel or PIE, NO_ROUTE / HOP_LIMIT: tagged packet that cannot be forwarded
+enum class DropReason { POLICER, QUEUE_OVERFLOW, AQM, NO_ROUTE, HOP_LIMIT };
+// ZERO_COPY forwards the received packet itself (payload, headers and byte tags kept)
+// NEW_PACKET sends a fresh zero-filled packet of the same size
+enum class ForwardingMode { ZERO_COPY, NEW_PACKET };
 
+// Cold per-channel data. The hot counters live in ChannelTable arrays.
 class ChannelTableEntry
 {
 public:
   ChannelTableEntry (uint32_t link_id, uint32_t capacity);
   uint32_t channel_id;
-  uint32_t channel_capacity; // megabits/s
-  uint32_t current_use;      // megabits/s
+  uint64_t channel_capacity; // bits/s
   Time last_measure;         // should update every second
-  uint32_t byte_counter;     // counts in kilobytes
-  uint64_t drop_threshold;   // not used (yet) - number of sent kilobytes before dropping
-  uint32_t dropped_packets;  // packet loss (usually kilobytes)
+  uint64_t drop_threshold;   // number of sent bytes per refresh interval before dropping
   uint64_t byte_counter_sum; // keep byte counter history
+  uint64_t packet_counter_sum; // keep packet counter history
   uint64_t dropped_packets_sum; // keep dropped packets history
+  uint64_t dropped_bytes_sum; // keep dropped bytes history
+  bool removed;              // see ChannelTable::RemoveChannelEntry
 };
 
+/**
+ * Channels are stored densely: channel_id maps to an index, and the
+ * counters touched per packet are kept in contiguous arrays by that index.
+ * Hot path callers resolve the index once (see FlowIndex) and use the *At methods.
+ * All counters are exact: bytes and packets, rates in bits/s.
+ * Every closed refresh interval also leaves a sample (utilisation and drop
+ * rate) in a fixed size ring per channel, queried by percentile.
+ * A removed channel keeps its index, so indices held elsewhere (paths,
+ * egress queues, scheduled events) never shift; only its id is forgotten.
+ */
 class ChannelTable
 {
 public:
   ChannelTable ();
-  void AddChannelEntry (uint32_t id, uint32_t capacity);
-  void UpdateChannelByteCounter (uint32_t id, uint32_t routed_bytes);
-  void UpdateChannelsCurrentUse();
-  void LogChannelTable () ;
-  void ScheduleChannelTableUpdate( Time dt );
-  void ScheduleChannelLog( );
-  uint32_t GetChannelAvailableCapacity(uint32_t channel_id);
-  uint32_t GetAvailableBytes(uint32_t channel_id);
-  void AddDroppedPacket(uint32_t channel_id);
+  static const uint32_t INVALID_INDEX = 0xffffffff; // dense index sentinel
+  static const uint32_t NO_CHANNEL_ID = 0xffffffff; // channel id sentinel, reserved
+  void AddChannelEntry (uint32_t id, uint32_t capacity); // capacity in megabits/s
+  void RemoveChannelEntry (uint32_t id);
+  void SetChannelCapacity (uint32_t id, uint32_t capacity); // megabits/s
+  uint32_t GetChannelIndex (uint32_t channel_id) const;
+  uint32_t GetChannelId (uint32_t index) const;
+  uint32_t GetChannelCount (void) const;
+  // counts into the open interval: callers refresh first, once per batch or event
+  void UpdateChannelByteCounterAt (uint32_t index, uint32_t routed_bytes);
+  void UpdateChannelsCurrentUse(); // brings the rate estimates up to now, call before reading or counting
+  void LogChannelTable (Time interval_end) ;
+  void ScheduleChannelTableUpdate( Time dt ); // starts measuring, first interval ends dt from now
+  uint64_t GetChannelCapacityAt(uint32_t index) const; // bits/s
+  uint64_t GetChannelAvailableCapacity(uint32_t channel_id) const; // bits/s
+  uint64_t GetChannelAvailableCapacityAt(uint32_t index) const;
+  uint64_t GetAvailableBytes(uint32_t channel_id) const;
+  uint64_t GetAvailableBytesAt(uint32_t index) const;
+  void AddDroppedPacketAt(uint32_t index, uint32_t dropped_bytes);
+  void SetRateEstimator(RateEstimator estimator);
+  void SetEwmaAlpha(double alpha);
+  void SetRateWindow(uint32_t intervals);
+  void SetRefreshInterval(Time interval); // length of the measurement intervals
+  Time GetRefreshInterval(void) const;
+  void UpdateChannelDelayAt(uint32_t index, Time rtt);
+  double GetChannelDelayAt(uint32_t index) const; // seconds, 0 until measured
+  void UpdateDeliveryAt(uint32_t index, uint64_t delivered_packets, uint64_t delivered_bytes,
+                        uint64_t lost_packets); // cumulative counters from a receiver report
+  double GetChannelLossRatioAt(uint32_t index) const;
+  uint64_t GetChannelDeliveryRateAt(uint32_t index) const; // bits/s
+  void SetShaperBurst(uint32_t bytes); // 0 = one refresh interval at capacity
+  bool ConsumeTokensAt(uint32_t index, uint32_t bytes);
+  bool ReserveTokensAt(uint32_t index, uint32_t bytes, Time &delay);
+  // called with (channel id, interval end, old rate, new rate) in bits/s at every refresh
+  void SetRateCallback(Callback<void, uint32_t, Time, uint64_t, uint64_t> callback);
+  void SetStatsWriter(ChannelStatsWriter *writer); // one record per channel and refresh, 0 disables
+  // History of the last intervals, percentile in [0, 1], 0 while empty
+  void SetHistorySize(uint32_t intervals); // clears the history
+  double GetUtilisationPercentile(uint32_t channel_id, double percentile) const; // use / capacity
+  double GetUtilisationPercentileAt(uint32_t index, double percentile) const;
+  double GetDropRatePercentile(uint32_t channel_id, double percentile) const; // dropped / offered packets
+  double GetDropRatePercentileAt(uint32_t index, double percentile) const;
+  uint64_t GetChannelP95UseAt(uint32_t index) const; // bits/s, refreshed once per interval
 
 private:
-  std::list<ChannelTableEntry> entries;
+  void CloseInterval(Time end);
+  void RefillTokensAt(uint32_t index);
+  uint64_t GetShaperBurstAt(uint32_t index) const;
+  uint64_t EstimateCurrentUse(uint32_t index, uint64_t sample);
+  void ResetRateEstimator(void);
+  void RecordHistory(const std::vector<uint64_t> &samples); // raw bits/s of the interval, per channel
+  void UpdatePercentiles(void);
+  double HistoryPercentileAt(const std::vector<float> &samples, uint32_t index, double percentile) const;
+
+  RateEstimator rateEstimator;
+  double ewma_alpha;
+  double refresh_interval;               // seconds
+  uint32_t rate_window;                  // intervals kept by SLIDING_WINDOW
+  uint32_t window_position;
+  std::vector<uint64_t> window_samples;  // rate_window samples per channel, bits/s
+  std::vector<uint64_t> window_sum;
+  std::vector<uint32_t> window_fill;
+  uint32_t shaper_burst;                 // bytes
+  std::vector<double> shaper_tokens;     // bytes, negative while shaping a backlog
+  std::vector<Time> shaper_last_refill;
+  Callback<void, uint32_t, Time, uint64_t, uint64_t> rate_callback;
+  ChannelStatsWriter *stats_writer;
+  bool refresh_started;
+  Time next_refresh;                     // end of the interval being counted
+  // History ring, history_size samples per channel
+  uint32_t history_size;
+  uint32_t history_position;
+  std::vector<uint32_t> history_fill;
+  std::vector<float> history_utilisation;
+  std::vector<float> history_drop_rate;
+  std::vector<uint64_t> p95_use;         // bits/s, for PERCENTILE_RATE
+
+  std::vector<ChannelTableEntry> entries;
+  std::unordered_map<uint32_t, uint32_t> channel_index; // channel_id -> index
+  // Hot counters, indexed like entries
+  std::vector<uint64_t> byte_counter;    // bytes sent in the current interval
+  std::vector<uint64_t> packet_counter;  // packets sent in the current interval
+  std::vector<uint64_t> dropped_packets; // packets dropped in the current interval
+  std::vector<uint64_t> dropped_bytes;   // bytes dropped in the current interval
+  std::vector<uint64_t> current_use;     // bits/s
+  std::vector<double> channel_delay;     // smoothed one-way delay, seconds
+  // Receiver feedback
+  std::vector<uint64_t> reported_packets;
+  std::vector<uint64_t> reported_bytes;
+  std::vector<uint64_t> reported_lost;
+  std::vector<Time> last_report;
+  std::vector<double> loss_ratio;        // smoothed lost / (lost + delivered)
+  std::vector<uint64_t> delivery_rate;   // bits/s delivered between the last two reports
 };
 
 class NodeTableEntry
@@ -80,7 +219,12 @@ public:
   Address dest_addr;
   uint16_t dest_port;
   Ptr<Socket> dest_socket;
+  Address local_addr;  // sending socket address, for the TxWithAddresses trace
+  Address remote_addr; // dest_addr and dest_port as a socket address
   uint32_t channel_id;
+  uint32_t channel_index; // ChannelTable index, resolved by FlowIndex::Build
+  int64_t wrr_current_weight; // WEIGHTED_ROUND_ROBIN state
+  uint32_t tx_sequence;       // next UdpMultipathHeader channel sequence number
 };
 
 
@@ -88,12 +232,27 @@ class NodeTable
 {
 public:
   NodeTable ();
-  uint32_t FindSocketChannel( Ptr<Socket> ); // returns channel_id
   void AddNodeEntry( uint32_t node, Address addr, uint16_t port, Ptr<Socket> dest_socket, uint32_t channel_id );
-  std::list<NodeTableEntry> GetAvailableChannels ( uint32_t node_id );
+  NodeTableEntry * FindNodeEntry ( Address addr, uint16_t port, uint32_t node, uint32_t channel_id );
+  // moves entry to retired, so pointers to it held by queued packets stay valid
+  void RetireNodeEntry ( NodeTableEntry *entry );
   void LogNodeTable( void );
-  NodeTableEntry ChooseBestPath ( std::list<NodeTableEntry>, BalancingAlgorithm algorithm, ChannelTable channelTable );
+  // candidates is a view into entries; nothing is copied or allocated per call
+  // flow_hash identifies the source flow (used by FLOW_AFFINITY)
+  NodeTableEntry * ChooseBestPath ( const std::vector<NodeTableEntry *> &candidates, BalancingAlgorithm algorithm,
+                                    const ChannelTable &channelTable, uint64_t flow_hash = 0 );
+  // the candidate other than chosen with the most spare capacity (chosen if it is the only one)
+  NodeTableEntry * ChooseSparePath ( const std::vector<NodeTableEntry *> &candidates, NodeTableEntry *chosen,
+                                     const ChannelTable &channelTable );
+  void SetAffinityThreshold( double utilisation );
   std::list<NodeTableEntry> entries;
+  std::list<NodeTableEntry> retired; // removed at runtime, their dest_socket is 0
+
+private:
+  NodeTableEntry * ChooseFlowAffinityPath ( const std::vector<NodeTableEntry *> &candidates,
+                                            const ChannelTable &channelTable, uint64_t flow_hash );
+  double affinity_threshold; // channel utilisation (0..1) above which flows are moved away
+  std::unordered_map<uint64_t, NodeTableEntry *> flow_assignments; // flows moved off their natural channel
 };
 
 class PathTableEntry
@@ -111,12 +270,115 @@ class PathTable
 public:
   PathTable ();
   void AddPathTableEntry( Address src_addr, uint16_t src_port, uint32_t node_id, Ptr<Socket> socket);
-  uint32_t FindDestinationNodeForPath( Ipv4Address src_addr, uint16_t src_port );
   void LogPathTable( void );
-  uint16_t FindPortFromSocket ( Ptr<Socket> socket );
   std::list<PathTableEntry> entries;
 };
 
+/**
+ * Compiled view of PathTable + NodeTable.
+ * Resolves (listen socket, source address) straight to the candidate
+ * channels of the destination node. Candidates point into NodeTable::entries,
+ * so the index must be rebuilt whenever the tables change.
+ */
+class FlowIndexEntry
+{
+public:
+  FlowIndexEntry ();
+  uint16_t listen_port;
+  uint32_t node_id;
+  std::vector<NodeTableEntry *> candidates;
+  // Per-flow state, kept across rebuilds
+  uint32_t flow_id;
+  uint32_t next_seq;
+  std::vector<uint8_t> fec_parity; // XOR of the payloads of the current FEC group
+  uint16_t fec_length;             // XOR of their lengths
+  uint32_t fec_count;              // data packets in the current FEC group
+};
+
+class FlowIndex
+{
+public:
+  FlowIndex ();
+  void Build ( PathTable &pathTable, NodeTable &nodeTable, const ChannelTable &channelTable );
+  void Invalidate ( void );
+  bool IsValid ( void ) const;
+  // node id of this router, kept in the high bits of the flow ids it assigns
+  void SetOriginId ( uint32_t origin_id );
+  uint16_t FindPortFromSocket ( Ptr<Socket> socket ) const;
+  uint32_t FindChannelIndexFromSocket ( Ptr<Socket> socket ) const;
+  FlowIndexEntry * Lookup ( uint16_t listen_port, Ipv4Address src_addr );
+  // candidates towards a final destination, for packets carrying a path tag
+  FlowIndexEntry * LookupNode ( uint32_t node_id );
+  // Incremental updates of a valid index, for tables changed while running
+  void AddNextHop ( NodeTableEntry *entry );
+  void RemoveNextHop ( NodeTableEntry *entry );
+  void AddPath ( const PathTableEntry &entry );
+  void RemovePath ( const PathTableEntry &entry, bool socket_closed );
+  // drops the partial FEC groups, when the redundancy settings change
+  void ResetFecGroups ( void );
+  // FLOW_AFFINITY hash of a source flow: source address, source port and listen port
+  static uint64_t MakeFlowHash ( Ipv4Address src_addr, uint16_t src_port, uint16_t listen_port );
+
+private:
+  static uint64_t MakeKey ( uint16_t listen_port, Ipv4Address src_addr );
+  uint32_t NextFlowId ( void );
+  std::unordered_map<Socket *, uint16_t> socket_ports;
+  std::unordered_map<Socket *, uint32_t> socket_channels; // sending socket -> channel index
+  std::unordered_map<uint64_t, FlowIndexEntry> flows;
+  std::unordered_map<uint32_t, FlowIndexEntry> nodes; // node id -> candidates
+  uint32_t origin_id;
+  uint32_t next_flow_id;
+  bool valid;
+};
+
+// A delay probe sent and not echoed yet
+class ProbeRecord
+{
+public:
+  ProbeRecord ();
+  uint32_t seq;
+  Time sent;
+  bool pending;
+};
+
+class EgressQueueItem
+{
+public:
+  EgressQueueItem (Ptr<Packet> p, NodeTableEntry *path);
+  Ptr<Packet> packet;
+  NodeTableEntry *path;
+  Time enqueue_time;
+};
+
+/**
+ * Bounded FIFO in front of one channel. It is drained by an event paced
+ * at the channel capacity, so short bursts wait instead of being dropped.
+ */
+class EgressQueue
+{
+public:
+  EgressQueue ();
+  bool RedDrop (uint32_t depth, double random);
+  bool CodelDrop (const EgressQueueItem &item, Time now);
+  bool PieDrop (uint64_t capacity, double random, Time now);
+  std::deque<EgressQueueItem> items;
+  uint64_t bytes;
+  Time next_transmit;  // channel is busy until then
+  EventId drain_event; //!< Event to send the head of the queue
+  // RED state
+  double red_average;   // average queue length, packets
+  uint32_t red_count;   // packets accepted since the last early drop
+  // CoDel state
+  Time codel_first_above_time;
+  Time codel_drop_next;
+  uint32_t codel_count;
+  bool codel_dropping;
+  // PIE state
+  double pie_probability;
+  Time pie_last_update;
+  double pie_old_delay; // seconds
+};
+
 /**
  * \ingroup applications 
  * \defgroup udpmultipathrouter
@@ -142,13 +404,100 @@ public:
   virtual ~UdpMultipathRouter ();
   void CreatePath (Address source_ip, uint16_t source_port, Address dest_ip, uint16_t dest_port,
                    uint32_t node_id, uint32_t channel_id);
+  // Multi-hop: a next hop reachable for tagged packets only, and a port receiving them
+  void CreateNextHop (Address dest_ip, uint16_t dest_port, uint32_t node_id, uint32_t channel_id);
+  void AddTransitPort (uint16_t listen_port);
+  void SetPathTags ( bool tags );
+  void SetReceiveBudget ( uint32_t packets ); // per HandleRead call, 0 drains the socket
+  void SetStatsFile ( std::string path ); // binary channel samples, see udp-multipath-stats.h
+
+  /**
+   * TracedCallback signature for routing decisions.
+   *
+   * \param [in] packet The packet being routed.
+   * \param [in] node_id The destination node id.
+   * \param [in] channel_id The channel chosen for it.
+   */
+  typedef void (* RouteTracedCallback)
+    (Ptr<const Packet> packet, uint32_t node_id, uint32_t channel_id);
+
+  /**
+   * TracedCallback signature for dropped packets.
+   *
+   * \param [in] packet The dropped packet.
+   * \param [in] reason Why it was dropped.
+   * \param [in] channel_id The channel it was meant for, ChannelTable::NO_CHANNEL_ID
+   *                        if it was dropped before a channel was chosen.
+   */
+  typedef void (* DropTracedCallback)
+    (Ptr<const Packet> packet, DropReason reason, uint32_t channel_id);
+
+  /**
+   * TracedCallback signature for per-channel values, TracedValue style.
+   *
+   * \param [in] channel_id The channel the value belongs to.
+   * \param [in] oldValue The previous value.
+   * \param [in] newValue The current value.
+   */
+  typedef void (* ChannelValueTracedCallback)
+    (uint32_t channel_id, uint64_t oldValue, uint64_t newValue);
+
+  /**
+   * TracedCallback signature for the channel rate estimates. Intervals are
+   * closed lazily, so the trace may fire later than the interval it reports.
+   *
+   * \param [in] channel_id The channel the rate belongs to.
+   * \param [in] intervalEnd End of the refresh interval the new rate covers.
+   * \param [in] oldValue The previous rate, in bits/s.
+   * \param [in] newValue The current rate, in bits/s.
+   */
+  typedef void (* ChannelRateTracedCallback)
+    (uint32_t channel_id, Time intervalEnd, uint64_t oldValue, uint64_t newValue);
   void SetLoadBalancing( BalancingAlgorithm algorithm );
   void SetDropMode ( DropMode drop_mode);
+  void SetForwardingMode ( ForwardingMode mode );
+  void SetRateEstimator ( RateEstimator estimator );
+  void SetEwmaAlpha ( double alpha );
+  void SetRateWindow ( uint32_t intervals );
+  void SetHistorySize ( uint32_t intervals ); // refresh intervals kept for the percentiles
+  void SetRefreshInterval ( Time interval );
+  // Tables from text, entries separated by ';' (the Channels and Paths attributes)
+  // channel: "<channel id> <capacity Mbps>"
+  // path:    "<source address> <source port> <next hop address> <next hop port> <node id> <channel id>"
+  void AddChannels ( std::string channels );
+  void AddPaths ( std::string paths );
+  // Tables loaded at StartApplication, one entry per line ('#' starts a comment):
+  //   channel <channel id> <capacity Mbps>
+  //   path    <source address> <source port> <next hop address> <next hop port> <node id> <channel id>
+  //   nexthop <next hop address> <next hop port> <node id> <channel id>
+  //   transit <listen port>
+  void SetTablesFile ( std::string path );
+  // Table changes that also work while the application runs: sockets are
+  // opened and closed as needed and the flow index is updated in place.
+  // Packets already queued for a removed next hop are dropped (NO_ROUTE).
+  void AddChannel ( uint32_t channel_id, uint32_t capacity ); // megabits/s, above 0
+  void RemoveChannel ( uint32_t channel_id ); // and every next hop over it
+  void SetChannelCapacity ( uint32_t channel_id, uint32_t capacity ); // megabits/s, above 0
+  void RemovePath ( Address source_ip, uint16_t source_port ); // keeps the next hops
+  void RemoveNextHop ( Address dest_ip, uint16_t dest_port, uint32_t node_id, uint32_t channel_id );
+  void SetFlowAffinityThreshold ( double utilisation );
+  void SetShaperBurst ( uint32_t bytes );
+  void SetShaperQueueing ( bool queueing );
+  void SetEgressQueue ( uint32_t depth, QueueDropPolicy policy ); // depth in packets, 0 disables
+  void SetQueueDiscipline ( QueueDiscipline discipline );
+  // Probes prefix a SeqTsHeader to every packet sent. Delay samples come back
+  // either in the reports of a UdpMultipathSink (with the multipath header and
+  // SetReceiverReports), or from a next hop that echoes whole datagrams. Any
+  // other receiver sees the probe as payload
+  void SetDelayProbing ( bool probing );
+  void SetMultipathHeader ( bool stamp );
+  void SetReceiverReports ( uint16_t report_port );
+  void SetRedundancy ( RedundancyMode mode, uint8_t fec_group_size );
   // Tables
   ChannelTable channelTable;
-  ChannelTable historicChannelTable; // Used for logging purposes only
   NodeTable nodeTable;
   PathTable pathTable;
+  FlowIndex flowIndex; // rebuilt from pathTable/nodeTable when they change
 
 protected:
   virtual void DoDispose (void);
@@ -158,6 +507,11 @@ private:
   virtual void StopApplication (void);
 
   void HandleRead (Ptr<Socket> socket);
+  void HandleEcho (Ptr<Socket> socket);
+  bool IsProbing (void) const;
+  // true once for a probe still outstanding with this sequence number and timestamp
+  bool MatchProbe (uint32_t seq, Time sent);
+  void HandleReport (Ptr<Socket> socket);
   void closeReceivingSocket(Ptr<Socket> m_socket);
   void closeReceivingSockets (void);
   Ptr<Socket> initReceivingSocket (Ptr<Socket> m_socket, uint16_t m_port);
@@ -165,16 +519,59 @@ private:
   Ptr<Socket> initSendingSocket (Ptr<Socket> m_socket, uint16_t m_port, Address address);
   void initSendingSockets (void);
 
-  void RoutePacket (uint32_t packet_size, Address address, Ptr<Socket> socket);
+  // flow is 0 for packets of unknown sources (routed by path tag, if enabled)
+  void RoutePacket (Ptr<Packet> packet, FlowIndexEntry *flow, uint64_t flow_hash);
+  void BuildFlowIndex (void);
 
   void CheckIpv4 (Address ipv4address, uint16_t m_port);
+  void AddChannelFields (std::istream &fields, const std::string &where);
+  void AddPathFields (std::istream &fields, const std::string &where);
+  void LoadTablesFile (void);
+  void OpenPath (PathTableEntry &entry);
+  void OpenNextHop (NodeTableEntry *entry);
+  void CloseNextHop (NodeTableEntry *entry);
 
-  void Send (uint32_t packet_size, Ptr<Socket> m_socket, Address dest_addr, uint16_t dest_port);
-  void ScheduleTransmit (Time dt, uint32_t packet_size, Ptr<Socket> s, Address addr, uint16_t port);
+  void Egress (Ptr<Packet> packet, NodeTableEntry *path); // drop mode, then Forward
+  void Forward (Ptr<Packet> packet, NodeTableEntry *path, Time delay);
+  void DropPacket (Ptr<const Packet> packet, DropReason reason, uint32_t channel_index);
+  void NotifyQueueLength (uint32_t channel_index, uint64_t old_length);
+  void NotifyChannelRate (uint32_t channel_id, Time interval_end, uint64_t old_rate, uint64_t new_rate);
+  void SendScheduled (Ptr<Packet> packet, NodeTableEntry *path);
+  Ptr<Packet> AddParity (Ptr<Packet> packet, FlowIndexEntry *flow); // parity packet once the group is full, 0 before
+  void Send (Ptr<Packet> packet, NodeTableEntry *path);
+  void ScheduleTransmit (Time dt, Ptr<Packet> packet, NodeTableEntry *path);
+  void CancelPendingSends (void);
+  void CancelPendingReads (void);
+  void Enqueue (Ptr<Packet> packet, NodeTableEntry *path);
+  void DrainQueue (uint32_t channel_index);
+  void ScheduleDrain (uint32_t channel_index);
+  void FlushQueues (void);
 
   BalancingAlgorithm balancingAlgorithm; 
   DropMode dropMode; 
-  EventId m_sendEvent; //!< Event to send the next packet
+  ForwardingMode forwardingMode;
+  bool delayProbing;    // stamp forwarded packets and measure delay from their echoes
+  bool multipathHeader; // stamp forwarded packets with a UdpMultipathHeader
+  uint16_t reportPort;  // port receiving UdpMultipathSink reports, 0 disables
+  Ptr<Socket> m_reportSocket; //!< Socket receiving receiver reports
+  uint32_t receiveBudget; // packets taken from a socket per HandleRead call
+  bool pathTags;         // route packets of unknown sources by their path tag
+  RedundancyMode redundancyMode;
+  uint8_t fecGroupSize;  // data packets per XOR parity packet
+  std::vector<uint8_t> m_fecScratch; //!< payload copy buffer for XOR_PARITY
+  ChannelStatsWriter m_statsWriter; //!< channel samples file, if SetStatsFile was called
+  std::string m_tablesFile; //!< routing tables to load at start, empty for none
+  bool running;          // between StartApplication and StopApplication
+  uint32_t probeSeq;
+  std::vector<ProbeRecord> m_probes; //!< last PROBE_WINDOW probes, by sequence number
+  bool shaperQueueing; // TOKEN_BUCKET delays packets instead of dropping them
+  uint32_t queueDepth; // packets per egress queue, 0 sends immediately
+  QueueDropPolicy queueDropPolicy;
+  QueueDiscipline queueDiscipline;
+  Ptr<UniformRandomVariable> m_aqmRandom; //!< RED/PIE drop decisions
+  std::vector<EgressQueue> egressQueues; // indexed like channelTable
+  std::deque<EventId> m_sendEvents; //!< delayed sends, cancelled when the router stops
+  std::unordered_map<Socket *, EventId> m_readEvents; //!< HandleRead continuations past the receive budget
 //  Ptr<Socket> m_sending_socketsocket_3; //!< IPv4 Socket
   Address m_local; //!< local multicast address
 
@@ -186,6 +583,14 @@ private:
   TracedCallback<Ptr<const Packet> > m_txTrace;
   /// Callbacks for tracing the packet Tx events, includes source and destination addresses
   TracedCallback<Ptr<const Packet>, const Address &, const Address &> m_txTraceWithAddresses;
+  /// Callbacks for tracing routing decisions (destination node id, channel id)
+  TracedCallback<Ptr<const Packet>, uint32_t, uint32_t> m_routeTrace;
+  /// Callbacks for tracing dropped packets (reason, channel id)
+  TracedCallback<Ptr<const Packet>, DropReason, uint32_t> m_dropTrace;
+  /// Callbacks for tracing the estimated rate of each channel (channel id, old, new bits/s)
+  TracedCallback<uint32_t, Time, uint64_t, uint64_t> m_channelRateTrace;
+  /// Callbacks for tracing the egress queue length of each channel (channel id, old, new packets)
+  TracedCallback<uint32_t, uint64_t, uint64_t> m_queueLengthTrace;
 };
 
 } // namespace ns3
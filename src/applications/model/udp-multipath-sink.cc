@@ -0,0 +1,516 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright 2019 - Paolo, Eric
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "ns3/log.h"
+#include "ns3/ipv4-address.h"
+#include "ns3/inet-socket-address.h"
+#include "ns3/socket.h"
+#include "ns3/simulator.h"
+#include "ns3/packet.h"
+#include "ns3/uinteger.h"
+#include "ns3/seq-ts-header.h"
+
+#include "udp-multipath-sink.h"
+#include "udp-multipath-header.h"
+
+// flow sequence numbers remembered for duplicate removal, and FEC groups kept open
+#define DUPLICATE_WINDOW 4096
+
+namespace ns3 {
+
+NS_LOG_COMPONENT_DEFINE ("UdpMultipathSinkApplication");
+
+NS_OBJECT_ENSURE_REGISTERED (UdpMultipathSink);
+
+SinkChannelState::SinkChannelState ()
+{
+  received_packets = 0;
+  received_bytes = 0;
+  highest_seq = 0;
+  has_probe = false;
+  probe_seq = 0;
+}
+
+SinkFecGroup::SinkFecGroup ()
+{
+  length_xor = 0;
+  received_mask = 0;
+  has_parity = false;
+}
+
+SinkFlowState::SinkFlowState ()
+{
+  highest_seq = 0;
+  next_expected = 0;
+}
+
+TypeId
+UdpMultipathSink::GetTypeId (void)
+{
+  static TypeId tid = TypeId ("ns3::UdpMultipathSink")
+    .SetParent<Application> ()
+    .SetGroupName("Applications")
+    .AddConstructor<UdpMultipathSink> ()
+    .AddAttribute ("Port", "Port on which we listen for incoming packets.",
+                   UintegerValue (9),
+                   MakeUintegerAccessor (&UdpMultipathSink::m_port),
+                   MakeUintegerChecker<uint16_t> ())
+    .AddAttribute ("RouterAddress", "Address of the router receiving the reports.",
+                   AddressValue (),
+                   MakeAddressAccessor (&UdpMultipathSink::m_routerAddress),
+                   MakeAddressChecker ())
+    .AddAttribute ("RouterPort", "Report port of the router, 0 disables reports.",
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&UdpMultipathSink::m_routerPort),
+                   MakeUintegerChecker<uint16_t> ())
+    .AddAttribute ("ReportInterval", "Time between two receiver reports.",
+                   TimeValue (Seconds (0.1)),
+                   MakeTimeAccessor (&UdpMultipathSink::m_reportInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("ReorderWindow", "Packets buffered per flow to restore order, 0 disables reordering.",
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&UdpMultipathSink::m_reorderWindow),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("ReorderTimeout", "Longest time a flow waits for a missing packet.",
+                   TimeValue (MilliSeconds (50)),
+                   MakeTimeAccessor (&UdpMultipathSink::m_reorderTimeout),
+                   MakeTimeChecker ())
+    .AddTraceSource ("Rx", "A packet has been delivered",
+                     MakeTraceSourceAccessor (&UdpMultipathSink::m_rxTrace),
+                     "ns3::Packet::TracedCallback")
+  ;
+  return tid;
+}
+
+UdpMultipathSink::UdpMultipathSink ()
+{
+  NS_LOG_FUNCTION (this);
+  m_receivedPackets = 0;
+  m_receivedBytes = 0;
+  m_duplicatePackets = 0;
+  m_recoveredPackets = 0;
+  m_latePackets = 0;
+  m_receivedSinceReport = false;
+}
+
+UdpMultipathSink::~UdpMultipathSink ()
+{
+  NS_LOG_FUNCTION (this);
+}
+
+void
+UdpMultipathSink::DoDispose (void)
+{
+  NS_LOG_FUNCTION (this);
+  m_socket = 0;
+  m_reportSocket = 0;
+  Application::DoDispose ();
+}
+
+uint64_t
+UdpMultipathSink::GetReceivedPackets (void) const
+{
+  return m_receivedPackets;
+}
+
+uint64_t
+UdpMultipathSink::GetReceivedBytes (void) const
+{
+  return m_receivedBytes;
+}
+
+uint64_t
+UdpMultipathSink::GetDuplicatePackets (void) const
+{
+  return m_duplicatePackets;
+}
+
+uint64_t
+UdpMultipathSink::GetRecoveredPackets (void) const
+{
+  return m_recoveredPackets;
+}
+
+uint64_t
+UdpMultipathSink::GetLatePackets (void) const
+{
+  return m_latePackets;
+}
+
+void
+UdpMultipathSink::StartApplication (void)
+{
+  NS_LOG_FUNCTION (this);
+  TypeId tid = TypeId::LookupByName ("ns3::UdpSocketFactory");
+  if (m_socket == 0)
+    {
+      m_socket = Socket::CreateSocket (GetNode (), tid);
+      InetSocketAddress local = InetSocketAddress (Ipv4Address::GetAny (), m_port);
+      if (m_socket->Bind (local) == -1)
+        {
+          NS_FATAL_ERROR ("Failed to bind socket");
+        }
+    }
+  m_socket->SetRecvCallback (MakeCallback (&UdpMultipathSink::HandleRead, this));
+
+  if (m_routerPort != 0 && m_reportSocket == 0)
+    {
+      m_reportSocket = Socket::CreateSocket (GetNode (), tid);
+      if (m_reportSocket->Bind () == -1)
+        {
+          NS_FATAL_ERROR ("Failed to bind socket");
+        }
+      m_reportSocket->Connect (InetSocketAddress (Ipv4Address::ConvertFrom (m_routerAddress), m_routerPort));
+      m_reportEvent = Simulator::Schedule (m_reportInterval, &UdpMultipathSink::SendReport, this);
+    }
+}
+
+void
+UdpMultipathSink::StopApplication (void)
+{
+  NS_LOG_FUNCTION (this);
+  Simulator::Cancel (m_reportEvent);
+  // nothing else is coming, hand over what the reorder buffers still hold
+  std::map<uint32_t, SinkFlowState>::iterator it;
+  for (it = m_flows.begin (); it != m_flows.end (); ++it)
+    {
+      Simulator::Cancel (it->second.reorder_event);
+      while (!it->second.pending.empty ())
+        {
+          UdpMultipathSink::SkipGap (it->second);
+        }
+    }
+  if (m_socket != 0)
+    {
+      m_socket->Close ();
+      m_socket->SetRecvCallback (MakeNullCallback<void, Ptr<Socket> > ());
+    }
+  if (m_reportSocket != 0)
+    {
+      m_reportSocket->Close ();
+    }
+}
+
+void
+UdpMultipathSink::HandleRead (Ptr<Socket> socket)
+{
+  NS_LOG_FUNCTION (this << socket);
+  m_receivedSinceReport = true;
+  if (m_reportSocket != 0 && !m_reportEvent.IsRunning ())
+    {
+      m_reportEvent = Simulator::Schedule (m_reportInterval, &UdpMultipathSink::SendReport, this);
+    }
+  Ptr<Packet> packet;
+  Address from;
+  while ((packet = socket->RecvFrom (from)))
+    {
+      UdpMultipathHeader header;
+      if (packet->GetSize () < header.GetSerializedSize ())
+        {
+          NS_LOG_LOGIC ("Packet too short for a router header, ignored");
+          continue;
+        }
+      packet->RemoveHeader (header);
+      if (!header.IsValid ())
+        {
+          // the router was not stamping headers (SetMultipathHeader): this is payload
+          NS_LOG_LOGIC ("Packet without a router header, ignored");
+          continue;
+        }
+      SeqTsHeader probe;
+      if (header.HasProbe ())
+        {
+          // delay probe of the last router, not part of the payload
+          if (packet->GetSize () < probe.GetSerializedSize ())
+            {
+              continue;
+            }
+          packet->RemoveHeader (probe);
+        }
+      // channel statistics see every packet, copies and parity included
+      SinkChannelState &channel = m_channels[header.GetChannelId ()];
+      channel.received_packets++;
+      channel.received_bytes += packet->GetSize ();
+      if (header.GetChannelSeq () > channel.highest_seq)
+        {
+          channel.highest_seq = header.GetChannelSeq ();
+        }
+      NS_LOG_LOGIC ("At time " << Simulator::Now ().GetSeconds () << "s sink received "
+                    << packet->GetSize () << " bytes on channel " << header.GetChannelId ());
+      if (header.HasProbe ())
+        {
+          channel.has_probe = true;
+          channel.probe_seq = probe.GetSeq ();
+          channel.probe_sent = probe.GetTs ();
+          channel.probe_arrival = Simulator::Now ();
+        }
+
+      SinkFlowState &flow = m_flows[header.GetFlowId ()];
+      if (header.IsParity ())
+        {
+          UdpMultipathSink::AddToFecGroup (header.GetFlowId (), flow, header, packet);
+          continue;
+        }
+      if (!UdpMultipathSink::MarkDelivered (flow, header.GetFlowSeq ()))
+        {
+          if (flow.recovered.erase (header.GetFlowSeq ()) > 0)
+            {
+              // the parity overtook it on a faster channel: it was late, not lost
+              m_recoveredPackets--;
+              continue;
+            }
+          // the other copy of a duplicated packet
+          m_duplicatePackets++;
+          continue;
+        }
+      if (header.GetFecGroupSize () > 0)
+        {
+          UdpMultipathSink::AddToFecGroup (header.GetFlowId (), flow, header, packet);
+        }
+      UdpMultipathSink::Deliver (header.GetFlowId (), flow, header.GetFlowSeq (), packet);
+    }
+}
+
+bool
+UdpMultipathSink::MarkDelivered (SinkFlowState &flow, uint32_t seq)
+{
+  if (flow.highest_seq >= DUPLICATE_WINDOW && seq < flow.highest_seq - DUPLICATE_WINDOW)
+    {
+      // too old to tell, the redundant copy of it was delivered long ago
+      return false;
+    }
+  if (!flow.delivered.insert (seq).second)
+    {
+      return false;
+    }
+  if (seq > flow.highest_seq)
+    {
+      flow.highest_seq = seq;
+    }
+  while (flow.highest_seq >= DUPLICATE_WINDOW && !flow.delivered.empty ()
+         && *flow.delivered.begin () < flow.highest_seq - DUPLICATE_WINDOW)
+    {
+      flow.delivered.erase (flow.delivered.begin ());
+    }
+  return true;
+}
+
+void
+UdpMultipathSink::AddToFecGroup (uint32_t flow_id, SinkFlowState &flow, const UdpMultipathHeader &header, Ptr<Packet> packet)
+{
+  uint32_t group_size = header.GetFecGroupSize ();
+  // the router starts a new group when its redundancy settings change, so
+  // groups are not aligned on the group size: data packets carry their index
+  uint32_t base = header.IsParity () ? header.GetFlowSeq ()
+                                     : header.GetFlowSeq () - header.GetFecIndex ();
+  if (header.GetFecIndex () >= group_size)
+    {
+      return;
+    }
+  uint32_t position = header.GetFlowSeq () - base;
+  if (flow.highest_seq >= DUPLICATE_WINDOW && base < flow.highest_seq - DUPLICATE_WINDOW)
+    {
+      return;
+    }
+  SinkFecGroup &group = flow.fec_groups[base];
+  if (header.IsParity ())
+    {
+      if (group.has_parity)
+        {
+          return;
+        }
+      group.has_parity = true;
+      group.length_xor ^= header.GetFecLength ();
+    }
+  else
+    {
+      if (group.received_mask & (1u << position))
+        {
+          return;
+        }
+      group.received_mask |= 1u << position;
+      group.length_xor ^= packet->GetSize ();
+    }
+  uint32_t size = packet->GetSize ();
+  if (group.payload_xor.size () < size)
+    {
+      group.payload_xor.resize (size, 0);
+    }
+  if (m_fecScratch.size () < size)
+    {
+      m_fecScratch.resize (size);
+    }
+  if (size > 0)
+    {
+      packet->CopyData (&m_fecScratch[0], size);
+    }
+  for (uint32_t i = 0; i < size; i++)
+    {
+      group.payload_xor[i] ^= m_fecScratch[i];
+    }
+
+  uint32_t complete_mask = group_size >= 32 ? 0xffffffff : (1u << group_size) - 1;
+  uint32_t missing = complete_mask & ~group.received_mask;
+  if (group.has_parity && missing != 0 && (missing & (missing - 1)) == 0)
+    {
+      // exactly one data packet is missing: it is what is left in the accumulator
+      uint32_t lost = 0;
+      while (!(missing & (1u << lost)))
+        {
+          lost++;
+        }
+      uint32_t length = group.length_xor;
+      NS_ASSERT_MSG (length <= group.payload_xor.size (), "Inconsistent FEC group");
+      Ptr<Packet> recovered = length == 0 ? Create<Packet> () : Create<Packet> (&group.payload_xor[0], length);
+      group.received_mask = complete_mask;
+      if (UdpMultipathSink::MarkDelivered (flow, base + lost))
+        {
+          NS_LOG_LOGIC ("Recovered packet " << base + lost << " from parity");
+          m_recoveredPackets++;
+          flow.recovered.insert (base + lost);
+          UdpMultipathSink::Deliver (flow_id, flow, base + lost, recovered);
+        }
+    }
+  if (group.received_mask == complete_mask)
+    {
+      flow.fec_groups.erase (base);
+    }
+  while (!flow.fec_groups.empty () && flow.highest_seq >= DUPLICATE_WINDOW
+         && flow.fec_groups.begin ()->first < flow.highest_seq - DUPLICATE_WINDOW)
+    {
+      flow.fec_groups.erase (flow.fec_groups.begin ());
+    }
+  while (!flow.recovered.empty () && flow.highest_seq >= DUPLICATE_WINDOW
+         && *flow.recovered.begin () < flow.highest_seq - DUPLICATE_WINDOW)
+    {
+      flow.recovered.erase (flow.recovered.begin ());
+    }
+}
+
+void
+UdpMultipathSink::Deliver (uint32_t flow_id, SinkFlowState &flow, uint32_t seq, Ptr<Packet> packet)
+{
+  if (m_reorderWindow == 0)
+    {
+      UdpMultipathSink::Release (packet);
+      return;
+    }
+  if (seq < flow.next_expected)
+    {
+      // its gap was skipped already, delivering it now would break the order
+      NS_LOG_LOGIC ("Late packet " << seq << " of flow " << flow_id << " discarded");
+      m_latePackets++;
+      return;
+    }
+  flow.pending[seq] = packet;
+  UdpMultipathSink::ReleaseInOrder (flow);
+  while (flow.pending.size () > m_reorderWindow)
+    {
+      UdpMultipathSink::SkipGap (flow);
+    }
+  if (flow.pending.empty ())
+    {
+      Simulator::Cancel (flow.reorder_event);
+    }
+  else if (!flow.reorder_event.IsRunning ())
+    {
+      flow.reorder_event = Simulator::Schedule (m_reorderTimeout, &UdpMultipathSink::ReorderTimeout, this, flow_id);
+    }
+}
+
+void
+UdpMultipathSink::ReleaseInOrder (SinkFlowState &flow)
+{
+  std::map<uint32_t, Ptr<Packet> >::iterator it = flow.pending.begin ();
+  while (it != flow.pending.end () && it->first == flow.next_expected)
+    {
+      UdpMultipathSink::Release (it->second);
+      flow.next_expected++;
+      flow.pending.erase (it++);
+    }
+}
+
+void
+UdpMultipathSink::SkipGap (SinkFlowState &flow)
+{
+  NS_LOG_LOGIC ("Skipping packets " << flow.next_expected << " to " << flow.pending.begin ()->first - 1);
+  flow.next_expected = flow.pending.begin ()->first;
+  UdpMultipathSink::ReleaseInOrder (flow);
+}
+
+void
+UdpMultipathSink::ReorderTimeout (uint32_t flow_id)
+{
+  SinkFlowState &flow = m_flows[flow_id];
+  if (flow.pending.empty ())
+    {
+      return;
+    }
+  UdpMultipathSink::SkipGap (flow);
+  if (!flow.pending.empty ())
+    {
+      flow.reorder_event = Simulator::Schedule (m_reorderTimeout, &UdpMultipathSink::ReorderTimeout, this, flow_id);
+    }
+}
+
+void
+UdpMultipathSink::Release (Ptr<Packet> packet)
+{
+  m_receivedPackets++;
+  m_receivedBytes += packet->GetSize ();
+  m_rxTrace (packet);
+}
+
+void
+UdpMultipathSink::SendReport (void)
+{
+  NS_LOG_FUNCTION (this);
+  UdpMultipathReportHeader report;
+  std::map<uint32_t, SinkChannelState>::iterator it;
+  for (it = m_channels.begin (); it != m_channels.end (); ++it)
+    {
+      UdpMultipathReportEntry entry;
+      entry.channel_id = it->first;
+      entry.delivered_packets = it->second.received_packets;
+      entry.delivered_bytes = it->second.received_bytes;
+      // the router numbers the packets of each next hop from 0, and this
+      // sink is the only receiver of its next hop on the channel
+      uint64_t expected = static_cast<uint64_t> (it->second.highest_seq) + 1;
+      entry.lost_packets = expected > it->second.received_packets ? expected - it->second.received_packets : 0;
+      if (it->second.has_probe)
+        {
+          // the router subtracts the hold time, leaving forward delay plus report path
+          entry.probe_seq = it->second.probe_seq;
+          entry.probe_sent = it->second.probe_sent.GetTimeStep ();
+          entry.probe_hold = (Simulator::Now () - it->second.probe_arrival).GetNanoSeconds ();
+          it->second.has_probe = false;
+        }
+      report.AddEntry (entry);
+    }
+  Ptr<Packet> packet = Create<Packet> ();
+  packet->AddHeader (report);
+  m_reportSocket->Send (packet);
+  // an idle sink has nothing new to report: stop until the next packet
+  if (m_receivedSinceReport)
+    {
+      m_reportEvent = Simulator::Schedule (m_reportInterval, &UdpMultipathSink::SendReport, this);
+    }
+  m_receivedSinceReport = false;
+}
+
+} // namespace ns3
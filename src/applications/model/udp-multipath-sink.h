@@ -0,0 +1,162 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright 2019 - Paolo, Eric
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef UDP_MULTIPATH_SINK
+#define UDP_MULTIPATH_SINK
+
+#include "ns3/application.h"
+#include "ns3/event-id.h"
+#include "ns3/ptr.h"
+#include "ns3/address.h"
+#include "ns3/traced-callback.h"
+#include "ns3/nstime.h"
+#include <map>
+#include <set>
+#include <vector>
+
+namespace ns3 {
+
+class Socket;
+class Packet;
+class UdpMultipathHeader;
+
+/**
+ * Delivery counters of one channel as seen by the sink.
+ */
+class SinkChannelState
+{
+public:
+  SinkChannelState ();
+  uint64_t received_packets;
+  uint64_t received_bytes;
+  uint32_t highest_seq;
+  // last delay probe of the router, sent back in the next report
+  bool has_probe;
+  uint32_t probe_seq;
+  Time probe_sent;
+  Time probe_arrival;
+};
+
+/**
+ * XOR accumulator of one FEC group: data packets and the parity packet all
+ * fold into it, so once a single data packet is missing it is what remains.
+ */
+class SinkFecGroup
+{
+public:
+  SinkFecGroup ();
+  std::vector<uint8_t> payload_xor;
+  uint16_t length_xor;
+  uint32_t received_mask; // bit i set once data packet base + i arrived
+  bool has_parity;
+};
+
+/**
+ * End-to-end state of one flow, keyed by the flow id set by the router.
+ */
+class SinkFlowState
+{
+public:
+  SinkFlowState ();
+  std::set<uint32_t> delivered;   // flow sequence numbers inside the duplicate window
+  uint32_t highest_seq;
+  std::map<uint32_t, SinkFecGroup> fec_groups; // keyed by the first sequence of the group
+  std::set<uint32_t> recovered;   // rebuilt from parity, inside the duplicate window
+  // Reorder buffer
+  uint32_t next_expected;                 // next flow sequence handed to the application
+  std::map<uint32_t, Ptr<Packet> > pending; // packets waiting for a gap to fill
+  EventId reorder_event;                  // gives up on the gap after ReorderTimeout
+};
+
+/**
+ * \ingroup udpmultipathrouter
+ * \brief Receiver companion of UdpMultipathRouter
+ *
+ * Strips the UdpMultipathHeader stamped by the router, counts delivered
+ * bytes and lost packets per channel, and periodically reports them back
+ * to the router's report port. Packets sent redundantly by the router are
+ * delivered once: duplicates are dropped and a single loss per FEC group
+ * is rebuilt from the XOR parity packet. With a ReorderWindow, packets
+ * sprayed over several channels are handed to the application in flow
+ * sequence order; a gap is skipped once the window fills up or the
+ * ReorderTimeout expires.
+ */
+class UdpMultipathSink : public Application
+{
+public:
+  /**
+   * \brief Get the type ID.
+   * \return the object TypeId
+   */
+  static TypeId GetTypeId (void);
+  UdpMultipathSink ();
+  virtual ~UdpMultipathSink ();
+
+  uint64_t GetReceivedPackets (void) const;
+  uint64_t GetReceivedBytes (void) const;
+  uint64_t GetDuplicatePackets (void) const;
+  uint64_t GetRecoveredPackets (void) const;
+  uint64_t GetLatePackets (void) const;
+
+protected:
+  virtual void DoDispose (void);
+
+private:
+  virtual void StartApplication (void);
+  virtual void StopApplication (void);
+
+  void HandleRead (Ptr<Socket> socket);
+  void SendReport (void);
+  // true if seq was not delivered before; remembers it otherwise
+  bool MarkDelivered (SinkFlowState &flow, uint32_t seq);
+  void AddToFecGroup (uint32_t flow_id, SinkFlowState &flow, const UdpMultipathHeader &header, Ptr<Packet> packet);
+  // hands seq to the reorder buffer, or straight to the application without one
+  void Deliver (uint32_t flow_id, SinkFlowState &flow, uint32_t seq, Ptr<Packet> packet);
+  // releases the in-order prefix of the reorder buffer
+  void ReleaseInOrder (SinkFlowState &flow);
+  // skips the gap in front of the oldest buffered packet
+  void SkipGap (SinkFlowState &flow);
+  void ReorderTimeout (uint32_t flow_id);
+  void Release (Ptr<Packet> packet);
+
+  uint16_t m_port;          //!< Port on which we listen for packets
+  Address m_routerAddress;  //!< Router address reports are sent to
+  uint16_t m_routerPort;    //!< Router report port
+  Time m_reportInterval;    //!< Time between reports
+  uint32_t m_reorderWindow; //!< packets buffered per flow, 0 disables reordering
+  Time m_reorderTimeout;    //!< longest wait for a missing packet
+  Ptr<Socket> m_socket;     //!< Receiving socket
+  Ptr<Socket> m_reportSocket; //!< Socket connected to the router
+  EventId m_reportEvent;    //!< Event to send the next report
+  bool m_receivedSinceReport; //!< data arrived since the last report was sent
+  std::map<uint32_t, SinkChannelState> m_channels; //!< state per channel id
+  std::map<uint32_t, SinkFlowState> m_flows;       //!< state per flow id, unique across routers
+  uint64_t m_receivedPackets;
+  uint64_t m_receivedBytes;
+  uint64_t m_duplicatePackets; //!< copies discarded by the duplicate filter
+  uint64_t m_recoveredPackets; //!< packets rebuilt from XOR parity whose original never came
+  uint64_t m_latePackets;      //!< packets arriving after their gap was skipped
+  std::vector<uint8_t> m_fecScratch; //!< payload copy buffer for the FEC accumulators
+
+  /// Callbacks for tracing delivered packets (router header removed, in order with a reorder window)
+  TracedCallback<Ptr<const Packet> > m_rxTrace;
+};
+
+} // namespace ns3
+
+#endif /* UDP_MULTIPATH_SINK */
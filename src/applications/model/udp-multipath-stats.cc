@@ -0,0 +1,176 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright 2019 - Paolo, Eric
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "udp-multipath-stats.h"
+#include <cstring>
+
+namespace ns3 {
+
+// Fixed little endian encoding, independent of the host byte order
+static uint8_t *
+PutU64 (uint8_t *buffer, uint64_t value)
+{
+  for (int i = 0; i < 8; i++)
+    {
+      buffer[i] = static_cast<uint8_t> (value >> (8 * i));
+    }
+  return buffer + 8;
+}
+static uint8_t *
+PutU32 (uint8_t *buffer, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+    {
+      buffer[i] = static_cast<uint8_t> (value >> (8 * i));
+    }
+  return buffer + 4;
+}
+static const uint8_t *
+GetU64 (const uint8_t *buffer, uint64_t &value)
+{
+  value = 0;
+  for (int i = 0; i < 8; i++)
+    {
+      value |= static_cast<uint64_t> (buffer[i]) << (8 * i);
+    }
+  return buffer + 8;
+}
+static const uint8_t *
+GetU32 (const uint8_t *buffer, uint32_t &value)
+{
+  value = 0;
+  for (int i = 0; i < 4; i++)
+    {
+      value |= static_cast<uint32_t> (buffer[i]) << (8 * i);
+    }
+  return buffer + 4;
+}
+
+ChannelStatsRecord::ChannelStatsRecord ()
+{
+  time_ns = 0;
+  channel_id = 0;
+  capacity = 0;
+  current_use = 0;
+  bytes = 0;
+  packets = 0;
+  dropped_packets = 0;
+  dropped_bytes = 0;
+}
+
+/* ChannelStatsWriter methods */
+ChannelStatsWriter::ChannelStatsWriter ()
+{
+}
+ChannelStatsWriter::~ChannelStatsWriter ()
+{
+  Close ();
+}
+bool
+ChannelStatsWriter::Open (const std::string &path)
+{
+  Close ();
+  m_file.open (path.c_str (), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!m_file.is_open ())
+    {
+      return false;
+    }
+  uint8_t header[8];
+  std::memcpy (header, CHANNEL_STATS_MAGIC, 4);
+  header[4] = CHANNEL_STATS_VERSION & 0xff;
+  header[5] = CHANNEL_STATS_VERSION >> 8;
+  header[6] = CHANNEL_STATS_RECORD_SIZE & 0xff;
+  header[7] = CHANNEL_STATS_RECORD_SIZE >> 8;
+  m_file.write (reinterpret_cast<const char *> (header), sizeof (header));
+  return m_file.good ();
+}
+bool
+ChannelStatsWriter::IsOpen (void) const
+{
+  return m_file.is_open ();
+}
+void
+ChannelStatsWriter::Write (const ChannelStatsRecord &record)
+{
+  uint8_t buffer[CHANNEL_STATS_RECORD_SIZE];
+  uint8_t *p = buffer;
+  p = PutU64 (p, static_cast<uint64_t> (record.time_ns));
+  p = PutU32 (p, record.channel_id);
+  p = PutU64 (p, record.capacity);
+  p = PutU64 (p, record.current_use);
+  p = PutU64 (p, record.bytes);
+  p = PutU64 (p, record.packets);
+  p = PutU64 (p, record.dropped_packets);
+  p = PutU64 (p, record.dropped_bytes);
+  m_file.write (reinterpret_cast<const char *> (buffer), sizeof (buffer));
+}
+void
+ChannelStatsWriter::Close (void)
+{
+  if (m_file.is_open ())
+    {
+      m_file.close ();
+    }
+}
+
+/* ChannelStatsReader methods */
+ChannelStatsReader::ChannelStatsReader ()
+{
+}
+bool
+ChannelStatsReader::Open (const std::string &path)
+{
+  m_file.open (path.c_str (), std::ios::in | std::ios::binary);
+  uint8_t header[8];
+  if (!m_file.read (reinterpret_cast<char *> (header), sizeof (header)))
+    {
+      return false;
+    }
+  uint32_t version = header[4] | (header[5] << 8);
+  uint32_t record_size = header[6] | (header[7] << 8);
+  return std::memcmp (header, CHANNEL_STATS_MAGIC, 4) == 0
+         && version == CHANNEL_STATS_VERSION && record_size == CHANNEL_STATS_RECORD_SIZE;
+}
+bool
+ChannelStatsReader::Read (ChannelStatsRecord &record)
+{
+  uint8_t buffer[CHANNEL_STATS_RECORD_SIZE];
+  if (!m_file.read (reinterpret_cast<char *> (buffer), sizeof (buffer)))
+    {
+      return false;
+    }
+  const uint8_t *p = buffer;
+  uint64_t time_ns;
+  p = GetU64 (p, time_ns);
+  record.time_ns = static_cast<int64_t> (time_ns);
+  p = GetU32 (p, record.channel_id);
+  p = GetU64 (p, record.capacity);
+  p = GetU64 (p, record.current_use);
+  p = GetU64 (p, record.bytes);
+  p = GetU64 (p, record.packets);
+  p = GetU64 (p, record.dropped_packets);
+  p = GetU64 (p, record.dropped_bytes);
+  return true;
+}
+void
+ChannelStatsReader::Close (void)
+{
+  m_file.close ();
+}
+
+} // namespace ns3
@@ -0,0 +1,94 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright 2019 - Paolo, Eric
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef UDP_MULTIPATH_STATS
+#define UDP_MULTIPATH_STATS
+
+#include <stdint.h>
+#include <fstream>
+#include <string>
+
+// File layout: an 8 byte header ("UMPS", format version, record size, all
+// little endian) followed by fixed size little endian records, one per
+// channel and ChannelTable refresh. An idle gap of several refreshes is
+// written as its first and last interval only, both with zero counters.
+#define CHANNEL_STATS_MAGIC "UMPS"
+#define CHANNEL_STATS_VERSION 1
+#define CHANNEL_STATS_RECORD_SIZE (8 + 4 + 8 * 6)
+
+namespace ns3 {
+
+/**
+ * One channel sample: what the router used and dropped on the channel
+ * during the refresh interval ending at time_ns.
+ */
+class ChannelStatsRecord
+{
+public:
+  ChannelStatsRecord ();
+  int64_t time_ns;
+  uint32_t channel_id;
+  uint64_t capacity;        // bits/s
+  uint64_t current_use;     // bits/s, as estimated by the ChannelTable
+  uint64_t bytes;           // sent in the interval
+  uint64_t packets;         // sent in the interval
+  uint64_t dropped_packets; // dropped in the interval
+  uint64_t dropped_bytes;   // dropped in the interval
+};
+
+/**
+ * \ingroup udpmultipathrouter
+ * \brief Appends ChannelStatsRecords to a compact binary file
+ *
+ * Does not depend on the simulator, so the converter program can link
+ * it on its own. Records are buffered by the stream and written as raw
+ * bytes; there is no text formatting during the simulation.
+ */
+class ChannelStatsWriter
+{
+public:
+  ChannelStatsWriter ();
+  ~ChannelStatsWriter ();
+  bool Open (const std::string &path);
+  bool IsOpen (void) const;
+  void Write (const ChannelStatsRecord &record);
+  void Close (void);
+
+private:
+  std::ofstream m_file;
+};
+
+/**
+ * \ingroup udpmultipathrouter
+ * \brief Reads back the files written by ChannelStatsWriter
+ */
+class ChannelStatsReader
+{
+public:
+  ChannelStatsReader ();
+  bool Open (const std::string &path); // false if missing or not a stats file
+  bool Read (ChannelStatsRecord &record); // false at end of file
+  void Close (void);
+
+private:
+  std::ifstream m_file;
+};
+
+} // namespace ns3
+
+#endif /* UDP_MULTIPATH_STATS */
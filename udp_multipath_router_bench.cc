@@ -0,0 +1,151 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "ns3/core-module.h"
+#include "ns3/network-module.h"
+#include "ns3/internet-module.h"
+#include "ns3/applications-module.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <streambuf>
+
+// Micro-benchmark for the router's per-packet path selection.
+// Replays the tables of scratch/udp_multipath_router_test and counts
+// heap allocations and time spent by the routing decision of each packet.
+// With --logs the router's log component is enabled at LOG_LEVEL_LOGIC and
+// its output discarded, so running the same binary against a module built
+// with UDP_MULTIPATH_HOT_PATH_LOG=0 and =1 (in a debug build, where NS_LOG is
+// compiled in) measures what the gated per-packet logs cost.
+
+// Only for the report: it is meaningful when CXXFLAGS set it for the whole build
+#ifndef UDP_MULTIPATH_HOT_PATH_LOG
+#define UDP_MULTIPATH_HOT_PATH_LOG 0
+#endif
+
+using namespace ns3;
+
+NS_LOG_COMPONENT_DEFINE ("MultipathUdpRouterBench");
+
+static uint64_t g_allocations = 0;
+
+// Swallows the log lines; they are still formatted
+class NullBuffer : public std::streambuf
+{
+protected:
+  virtual int overflow (int c)
+  {
+    return traits_type::not_eof (c);
+  }
+};
+
+void *
+operator new (std::size_t size)
+{
+  g_allocations++;
+  void *p = std::malloc (size);
+  if (p == 0)
+    {
+      throw std::bad_alloc ();
+    }
+  return p;
+}
+
+void
+operator delete (void *p) noexcept
+{
+  std::free (p);
+}
+
+int
+main (int argc, char *argv[])
+{
+  uint32_t nPackets = 1000000;
+  bool logs = false;
+
+  CommandLine cmd;
+  cmd.AddValue ("nPackets", "Number of routing decisions to measure", nPackets);
+  cmd.AddValue ("logs", "Enable the router log component at LOG_LEVEL_LOGIC (output discarded)", logs);
+  cmd.Parse (argc, argv);
+
+  NullBuffer nullBuffer;
+  std::streambuf *clogBuffer = std::clog.rdbuf ();
+  if (logs)
+    {
+      std::clog.rdbuf (&nullBuffer);
+      LogComponentEnable ("UdpMultipathRouterApplication", LOG_LEVEL_LOGIC);
+    }
+
+  Ipv4Address source ("10.1.1.1");
+
+  ChannelTable channelTable;
+  channelTable.AddChannelEntry ( 0, 100 ); // CSMA Channel
+  channelTable.AddChannelEntry ( 1, 72 );  // Wi-Fi 2.4 GHZ Channel
+
+  // Same paths as udp_multipath_router_test.cc (sockets are not needed here)
+  NodeTable nodeTable;
+  PathTable pathTable;
+  nodeTable.AddNodeEntry ( 0, Ipv4Address ("10.1.2.3"), 31, 0, 0 );
+  pathTable.AddPathTableEntry ( source, 9, 0, 0 );
+  nodeTable.AddNodeEntry ( 1, Ipv4Address ("10.1.2.4"), 32, 0, 0 );
+  pathTable.AddPathTableEntry ( source, 10, 1, 0 );
+  nodeTable.AddNodeEntry ( 1, Ipv4Address ("10.1.3.2"), 33, 0, 1 );
+  pathTable.AddPathTableEntry ( source, 11, 1, 0 );
+
+  FlowIndex flowIndex;
+  flowIndex.Build ( pathTable, nodeTable, channelTable );
+
+  BalancingAlgorithm algorithms[] = { BalancingAlgorithm::NO_BALANCING,
+                                      BalancingAlgorithm::TX_RATE,
+                                      BalancingAlgorithm::TX_DROP_THRESHOLD,
+                                      BalancingAlgorithm::WEIGHTED_ROUND_ROBIN,
+                                      BalancingAlgorithm::FLOW_AFFINITY,
+                                      BalancingAlgorithm::PERCENTILE_RATE };
+  const char *names[] = { "NO_BALANCING", "TX_RATE", "TX_DROP_THRESHOLD", "WEIGHTED_ROUND_ROBIN",
+                          "FLOW_AFFINITY", "PERCENTILE_RATE" };
+  uint32_t runs = sizeof (algorithms) / sizeof (algorithms[0]);
+
+  for (uint32_t a = 0; a < runs; a++)
+    {
+      uint64_t allocations_before = g_allocations;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+      for (uint32_t i = 0; i < nPackets; i++)
+        {
+          uint16_t listen_port = 9 + (i % 3);
+          // a handful of source ports, so FLOW_AFFINITY spreads several flows
+          uint16_t source_port = 49153 + (i / 3) % 8;
+          const FlowIndexEntry *flow = flowIndex.Lookup ( listen_port, source );
+          uint64_t flow_hash = FlowIndex::MakeFlowHash ( source, source_port, listen_port );
+          NodeTableEntry *path = nodeTable.ChooseBestPath ( flow->candidates, algorithms[a], channelTable,
+                                                            flow_hash );
+          channelTable.UpdateChannelByteCounterAt ( path->channel_index, 1024 );
+        }
+      std::chrono::nanoseconds elapsed = std::chrono::duration_cast<std::chrono::nanoseconds> (
+        std::chrono::steady_clock::now () - start);
+      uint64_t allocations = g_allocations - allocations_before;
+      std::cout << names[a] << " (hot path log " << UDP_MULTIPATH_HOT_PATH_LOG
+                << (logs ? ", logs on" : ", logs off") << "): " << nPackets << " packets, "
+                << allocations << " allocations, "
+                << static_cast<double> (allocations) / nPackets << " allocations/packet, "
+                << static_cast<double> (elapsed.count ()) / nPackets << " ns/packet"
+                << std::endl;
+    }
+
+  std::clog.rdbuf (clogBuffer);
+  return 0;
+}
@@ -0,0 +1,421 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "ns3/core-module.h"
+#include "ns3/network-module.h"
+#include "ns3/internet-module.h"
+#include "ns3/point-to-point-module.h"
+#include "ns3/applications-module.h"
+
+#include <algorithm>
+
+#define PACKET_INTERVAL 0.0001
+#define SINK_NODE 0  // destination node id shared by all routers
+#define LISTEN_PORT 9
+#define TRANSIT_PORT 20
+#define REPORT_PORT 30
+#define CHURN_DOWN 4.0   // r1-r3 branch removed
+#define CHURN_UP 6.0     // and added again
+#define CHURN_HALVE 7.0  // r1-r2 capacity halved
+#define DROP_REASONS (static_cast<int> (DropReason::HOP_LIMIT) + 1)
+
+// Network Topology
+//
+//                    r2
+//      10.2.2.0   /      \   10.2.4.0
+//       100Mbps  /        \
+// n0 ---------- r1         r4 ---------- n5
+//    10.2.1.0    \        /    10.2.6.0
+//       50Mbps    \      /
+//      10.2.3.0      r3      10.2.5.0
+//
+// r1 splits the flow of n0 between r2 and r3 and tags every packet with
+// its destination; r2, r3 and r4 only know the next hop towards it.
+
+using namespace ns3;
+
+NS_LOG_COMPONENT_DEFINE ("MultipathUdpRouterChainTest");
+
+static bool g_failed = false;
+
+// Prints the outcome of one expectation; any failure makes the exit status 1
+static void
+Check (bool ok, const std::string &what)
+{
+  std::cout << (ok ? "PASS: " : "FAIL: ") << what << std::endl;
+  g_failed = g_failed || !ok;
+}
+
+// What the Route and Drop traces of one router saw
+struct RouterCounts
+{
+  RouterCounts () : routed (0), unattributed (0)
+  {
+    std::fill (drops, drops + DROP_REASONS, 0);
+  }
+  uint64_t routed;
+  uint64_t drops[DROP_REASONS]; // by DropReason
+  uint64_t unattributed;        // channel drops reported without a channel id
+};
+
+// Channel choices and queues of r1, for the churn, affinity and queue checks
+static uint32_t g_lastChannel = ChannelTable::NO_CHANNEL_ID;
+static uint64_t g_channelSwitches = 0;
+static uint64_t g_removedChannelRoutes = 0;  // over channel 1 while it was removed
+static uint64_t g_restoredChannelRoutes = 0; // over channel 1 once it was back
+static uint64_t g_maxQueueLength = 0;
+
+static void
+CountRoute (RouterCounts *counts, Ptr<const Packet> packet, uint32_t node_id, uint32_t channel_id)
+{
+  counts->routed++;
+}
+
+static void
+CountDrop (RouterCounts *counts, Ptr<const Packet> packet, DropReason reason, uint32_t channel_id)
+{
+  counts->drops[static_cast<int> (reason)]++;
+  // only NO_ROUTE and HOP_LIMIT may happen before a channel is chosen
+  if (channel_id == ChannelTable::NO_CHANNEL_ID
+      && (reason == DropReason::POLICER || reason == DropReason::QUEUE_OVERFLOW || reason == DropReason::AQM))
+    {
+      counts->unattributed++;
+    }
+}
+
+static void
+TrackFirstHop (Ptr<const Packet> packet, uint32_t node_id, uint32_t channel_id)
+{
+  if (g_lastChannel != ChannelTable::NO_CHANNEL_ID && channel_id != g_lastChannel)
+    {
+      g_channelSwitches++;
+    }
+  g_lastChannel = channel_id;
+  double now = Simulator::Now ().GetSeconds ();
+  if (channel_id == 1 && now >= CHURN_DOWN && now < CHURN_UP)
+    {
+      g_removedChannelRoutes++;
+    }
+  else if (channel_id == 1 && now >= CHURN_UP)
+    {
+      g_restoredChannelRoutes++;
+    }
+}
+
+static void
+TrackQueueLength (uint32_t channel_id, uint64_t oldValue, uint64_t newValue)
+{
+  g_maxQueueLength = std::max (g_maxQueueLength, newValue);
+}
+
+int
+main (int argc, char *argv[])
+{
+  bool verbose = false;
+  uint32_t maxPackets = 50000;
+  uint32_t reorderWindow = 64;
+  bool churn = false;
+  uint32_t fecGroup = 0;
+  double lossRate = 0;
+  std::string algorithm = "WeightedRoundRobin";
+  std::string dropMode = "TxRate";
+  uint32_t queueDepth = 0;
+  std::string aqm = "Fifo";
+  bool reports = false;
+
+  CommandLine cmd;
+  cmd.AddValue ("verbose", "Log router and sink activity", verbose);
+  cmd.AddValue ("maxPackets", "Packets sent by the client", maxPackets);
+  cmd.AddValue ("reorderWindow", "Reorder window of the sink, 0 disables it", reorderWindow);
+  cmd.AddValue ("churn", "Take the r1-r3 branch down from 4 s to 6 s and halve r1-r2 at 7 s", churn);
+  cmd.AddValue ("fecGroup", "XOR parity group size at r1, 0 disables FEC", fecGroup);
+  cmd.AddValue ("lossRate", "Packet error rate on the r1-r3 link", lossRate);
+  cmd.AddValue ("algorithm", "BalancingAlgorithm of r1, e.g. WeightedRoundRobin or FlowAffinity", algorithm);
+  cmd.AddValue ("dropMode", "DropMode of r1: NoDropping, TxRate, TxDropThreshold or TokenBucket", dropMode);
+  cmd.AddValue ("queueDepth", "Egress queue of r1 in packets, 0 sends right away", queueDepth);
+  cmd.AddValue ("aqm", "Discipline of the r1 egress queues: Fifo, Red, CoDel or Pie", aqm);
+  cmd.AddValue ("reports", "r4 probes the sink link and the sink sends it receiver reports", reports);
+
+  cmd.Parse (argc,argv);
+
+  QueueDiscipline discipline = QueueDiscipline::FIFO;
+  if (aqm == "Red")
+    {
+      discipline = QueueDiscipline::RED;
+    }
+  else if (aqm == "CoDel")
+    {
+      discipline = QueueDiscipline::CODEL;
+    }
+  else if (aqm == "Pie")
+    {
+      discipline = QueueDiscipline::PIE;
+    }
+  else if (aqm != "Fifo")
+    {
+      NS_FATAL_ERROR ("Unknown queue discipline " << aqm);
+    }
+  if (discipline != QueueDiscipline::FIFO && queueDepth == 0)
+    {
+      NS_FATAL_ERROR ("--aqm needs an egress queue, set --queueDepth");
+    }
+
+  if (verbose)
+    {
+      LogComponentEnable ("UdpMultipathRouterApplication", LOG_LEVEL_INFO);
+      LogComponentEnable ("UdpMultipathSinkApplication", LOG_LEVEL_INFO);
+    }
+
+  // n0 client, n1-n4 routers r1-r4, n5 sink
+  NodeContainer nodes;
+  nodes.Create (6);
+
+  InternetStackHelper stack;
+  stack.Install (nodes);
+
+  PointToPointHelper pointToPoint;
+  pointToPoint.SetChannelAttribute ("Delay", StringValue ("2ms"));
+  Ipv4AddressHelper address;
+
+  pointToPoint.SetDeviceAttribute ("DataRate", StringValue ("1Gbps"));
+  address.SetBase ("10.2.1.0", "255.255.255.0");
+  Ipv4InterfaceContainer clientInterfaces = address.Assign (pointToPoint.Install (nodes.Get (0), nodes.Get (1)));
+
+  pointToPoint.SetDeviceAttribute ("DataRate", StringValue ("100Mbps"));
+  address.SetBase ("10.2.2.0", "255.255.255.0");
+  Ipv4InterfaceContainer r1r2Interfaces = address.Assign (pointToPoint.Install (nodes.Get (1), nodes.Get (2)));
+
+  pointToPoint.SetDeviceAttribute ("DataRate", StringValue ("50Mbps"));
+  address.SetBase ("10.2.3.0", "255.255.255.0");
+  NetDeviceContainer r1r3Devices = pointToPoint.Install (nodes.Get (1), nodes.Get (3));
+  Ipv4InterfaceContainer r1r3Interfaces = address.Assign (r1r3Devices);
+  if (lossRate > 0)
+    {
+      Ptr<RateErrorModel> errors = CreateObject<RateErrorModel> ();
+      errors->SetUnit (RateErrorModel::ERROR_UNIT_PACKET);
+      errors->SetRate (lossRate);
+      r1r3Devices.Get (1)->SetAttribute ("ReceiveErrorModel", PointerValue (errors));
+    }
+
+  pointToPoint.SetDeviceAttribute ("DataRate", StringValue ("1Gbps"));
+  address.SetBase ("10.2.4.0", "255.255.255.0");
+  Ipv4InterfaceContainer r2r4Interfaces = address.Assign (pointToPoint.Install (nodes.Get (2), nodes.Get (4)));
+
+  address.SetBase ("10.2.5.0", "255.255.255.0");
+  Ipv4InterfaceContainer r3r4Interfaces = address.Assign (pointToPoint.Install (nodes.Get (3), nodes.Get (4)));
+
+  address.SetBase ("10.2.6.0", "255.255.255.0");
+  Ipv4InterfaceContainer sinkInterfaces = address.Assign (pointToPoint.Install (nodes.Get (4), nodes.Get (5)));
+
+  // Sender
+  UdpClientHelper client (clientInterfaces.GetAddress (1), LISTEN_PORT);
+  client.SetAttribute ("MaxPackets", UintegerValue (maxPackets));
+  client.SetAttribute ("Interval", TimeValue (Seconds (PACKET_INTERVAL)));
+  client.SetAttribute ("PacketSize", UintegerValue (1024));
+  ApplicationContainer clientApps = client.Install (nodes.Get (0));
+  clientApps.Start (Seconds (2.0));
+  clientApps.Stop (Seconds (10.0));
+
+  // Receiver
+  UdpMultipathSinkHelper sink (LISTEN_PORT);
+  sink.SetAttribute ("ReorderWindow", UintegerValue (reorderWindow));
+  if (reports)
+    {
+      sink.SetAttribute ("RouterAddress", AddressValue (sinkInterfaces.GetAddress (0)));
+      sink.SetAttribute ("RouterPort", UintegerValue (REPORT_PORT));
+    }
+  ApplicationContainer sinkApps = sink.Install (nodes.Get (5));
+  sinkApps.Start (Seconds (1.0));
+  sinkApps.Stop (Seconds (10.0));
+
+  // r1: first router, balances the flow of n0 over r2 and r3
+  Ptr<UdpMultipathRouter> r1 = CreateObject<UdpMultipathRouter> ();
+  r1->channelTable.AddChannelEntry( 0, 100 ); // to r2
+  r1->channelTable.AddChannelEntry( 1, 50 );  // to r3
+  r1->CreatePath(
+                  clientInterfaces.GetAddress (0), // source address
+                  LISTEN_PORT,                     // source port
+                  r1r2Interfaces.GetAddress (1),   // next hop address
+                  TRANSIT_PORT,                    // next hop port
+                  SINK_NODE,                       // destination node id
+                  0                                // channel id
+                );
+  r1->CreateNextHop( r1r3Interfaces.GetAddress (1), TRANSIT_PORT, SINK_NODE, 1 );
+  r1->SetAttribute ("BalancingAlgorithm", StringValue (algorithm));
+  r1->SetAttribute ("DropMode", StringValue (dropMode));
+  if (queueDepth > 0)
+    {
+      r1->SetEgressQueue(queueDepth, QueueDropPolicy::DROP_TAIL);
+      r1->SetQueueDiscipline(discipline);
+    }
+  r1->SetPathTags(true);
+  if (fecGroup > 0)
+    {
+      // parity of each group goes out on the branch the last packet did not take
+      r1->SetRedundancy(RedundancyMode::XOR_PARITY, fecGroup);
+    }
+  nodes.Get (1)->AddApplication(r1);
+
+  // r2 and r3: parallel branches, forward tagged packets to r4
+  Ptr<UdpMultipathRouter> r2 = CreateObject<UdpMultipathRouter> ();
+  r2->channelTable.AddChannelEntry( 2, 1000 );
+  r2->AddTransitPort( TRANSIT_PORT );
+  r2->CreateNextHop( r2r4Interfaces.GetAddress (1), TRANSIT_PORT, SINK_NODE, 2 );
+  r2->SetPathTags(true);
+  nodes.Get (2)->AddApplication(r2);
+
+  Ptr<UdpMultipathRouter> r3 = CreateObject<UdpMultipathRouter> ();
+  r3->channelTable.AddChannelEntry( 3, 1000 );
+  r3->AddTransitPort( TRANSIT_PORT );
+  r3->CreateNextHop( r3r4Interfaces.GetAddress (1), TRANSIT_PORT, SINK_NODE, 3 );
+  r3->SetPathTags(true);
+  nodes.Get (3)->AddApplication(r3);
+
+  // r4: joins both branches and delivers to the sink
+  Ptr<UdpMultipathRouter> r4 = CreateObject<UdpMultipathRouter> ();
+  r4->channelTable.AddChannelEntry( 4, 1000 );
+  r4->AddTransitPort( TRANSIT_PORT );
+  r4->CreateNextHop( sinkInterfaces.GetAddress (1), LISTEN_PORT, SINK_NODE, 4 );
+  r4->SetPathTags(true);
+  if (reports)
+    {
+      // a sink does not echo, the probes come back in its reports
+      r4->SetReceiverReports(REPORT_PORT);
+      r4->SetDelayProbing(true);
+    }
+  nodes.Get (4)->AddApplication(r4);
+
+  RouterCounts counts[4];
+  Ptr<UdpMultipathRouter> routers[] = { r1, r2, r3, r4 };
+  for (uint32_t i = 0; i < 4; i++)
+    {
+      routers[i]->TraceConnectWithoutContext ("Route", MakeBoundCallback (&CountRoute, &counts[i]));
+      routers[i]->TraceConnectWithoutContext ("Drop", MakeBoundCallback (&CountDrop, &counts[i]));
+    }
+  r1->TraceConnectWithoutContext ("Route", MakeCallback (&TrackFirstHop));
+  r1->TraceConnectWithoutContext ("QueueLength", MakeCallback (&TrackQueueLength));
+
+  if (churn)
+    {
+      // tables change while the routers run; packets queued for r3 are dropped
+      Simulator::Schedule (Seconds (CHURN_DOWN), &UdpMultipathRouter::RemoveChannel, r1, 1);
+      Simulator::Schedule (Seconds (CHURN_UP), &UdpMultipathRouter::AddChannel, r1, 1, 50);
+      Simulator::Schedule (Seconds (CHURN_UP), &UdpMultipathRouter::CreateNextHop, r1,
+                           Address (r1r3Interfaces.GetAddress (1)), TRANSIT_PORT, SINK_NODE, 1);
+      Simulator::Schedule (Seconds (CHURN_HALVE), &UdpMultipathRouter::SetChannelCapacity, r1, 0, 50);
+    }
+
+  Simulator::Stop (Seconds (10.0));
+  Simulator::Run ();
+
+  Ptr<UdpMultipathSink> sinkApp = DynamicCast<UdpMultipathSink> (sinkApps.Get (0));
+  // the client stops after maxPackets or at 10 s, whichever comes first
+  double seconds = std::min (maxPackets * PACKET_INTERVAL, 8.0);
+  std::cout << "Delivered " << sinkApp->GetReceivedPackets () << " of " << maxPackets << " packets, "
+            << sinkApp->GetReceivedBytes () * 8 / seconds / 1e6 << " Mbps end-to-end, "
+            << sinkApp->GetLatePackets () << " late" << std::endl;
+
+  uint64_t delivered = sinkApp->GetReceivedPackets ();
+  uint64_t late = sinkApp->GetLatePackets ();
+  uint64_t dropped = 0;
+  uint64_t unattributed = 0;
+  uint64_t untagged = 0; // r2-r4 drops of packets they could not route by their tag
+  std::cout << "Dropped by r1-r4:";
+  for (uint32_t i = 0; i < 4; i++)
+    {
+      uint64_t router_drops = 0;
+      for (int reason = 0; reason < DROP_REASONS; reason++)
+        {
+          router_drops += counts[i].drops[reason];
+        }
+      std::cout << " " << router_drops;
+      dropped += router_drops;
+      unattributed += counts[i].unattributed;
+      if (i > 0)
+        {
+          untagged += counts[i].drops[static_cast<int> (DropReason::NO_ROUTE)]
+                      + counts[i].drops[static_cast<int> (DropReason::HOP_LIMIT)];
+        }
+    }
+  std::cout << std::endl;
+  // the client finished well before the routers stopped, nothing is still in flight
+  bool complete = 2.0 + maxPackets * PACKET_INTERVAL < 9.5;
+
+  Check (delivered <= maxPackets, "no packet delivered twice");
+  if (complete && lossRate == 0)
+    {
+      Check (delivered + late + dropped >= maxPackets, "every packet was delivered, late or dropped by a router");
+    }
+  Check (untagged == 0, "r2, r3 and r4 forwarded every packet by its path tag");
+  Check (unattributed == 0, "policer, queue and AQM drops name their channel");
+  if (algorithm == "WeightedRoundRobin")
+    {
+      Check (counts[1].routed > 0 && counts[2].routed > 0, "both branches carried traffic");
+    }
+  if (reorderWindow > 0 && lossRate == 0 && queueDepth == 0)
+    {
+      // the branches differ by a fraction of a millisecond, well inside the window
+      Check (late == 0, "reorder window restored the order without late packets");
+    }
+  if (churn)
+    {
+      Check (g_removedChannelRoutes == 0, "r1 routed nothing over channel 1 while it was removed");
+      if (algorithm == "WeightedRoundRobin" && 2.0 + maxPackets * PACKET_INTERVAL > CHURN_UP + 0.5)
+        {
+          Check (g_restoredChannelRoutes > 0, "r1 used channel 1 again once it was added back");
+        }
+      Check (counts[0].drops[static_cast<int> (DropReason::NO_ROUTE)] <= maxPackets / 100,
+             "removing channel 1 lost at most 1% of the packets");
+    }
+  if (algorithm == "FlowAffinity" && !churn)
+    {
+      // at most one move off the natural channel, and the flow stays where it went
+      std::cout << "r1 switched channels " << g_channelSwitches << " times" << std::endl;
+      Check (g_channelSwitches <= 2, "flow affinity kept the flow of n0 on one channel");
+    }
+  if (dropMode == "TokenBucket" && algorithm == "WeightedRoundRobin")
+    {
+      // n0 sends about 82 Mbps, split by capacity it fits both channels
+      Check (counts[0].drops[static_cast<int> (DropReason::POLICER)] == 0,
+             "token bucket let a load under capacity through");
+    }
+  if (queueDepth > 0)
+    {
+      std::cout << "Longest r1 egress queue " << g_maxQueueLength << " packets, "
+                << counts[0].drops[static_cast<int> (DropReason::AQM)] << " AQM drops" << std::endl;
+      Check (g_maxQueueLength <= queueDepth, "r1 egress queues stayed within their depth");
+    }
+  if (reports)
+    {
+      uint32_t index = r4->channelTable.GetChannelIndex (4);
+      std::cout << "r4 to sink: delivery rate " << r4->channelTable.GetChannelDeliveryRateAt (index) / 1e6
+                << " Mbps, loss ratio " << r4->channelTable.GetChannelLossRatioAt (index)
+                << ", delay " << r4->channelTable.GetChannelDelayAt (index) * 1e3 << " ms" << std::endl;
+      Check (r4->channelTable.GetChannelDeliveryRateAt (index) > 0, "r4 got receiver reports from the sink");
+      Check (r4->channelTable.GetChannelDelayAt (index) > 0, "r4 measured the sink link delay from the reports");
+      Check (r4->channelTable.GetChannelLossRatioAt (index) == 0, "r4 saw no loss on the lossless sink link");
+    }
+  if (fecGroup > 0)
+    {
+      std::cout << "FEC recovered " << sinkApp->GetRecoveredPackets () << " packets" << std::endl;
+      // without losses nothing is missing, so nothing may be counted as recovered
+      Check (lossRate > 0 ? sinkApp->GetRecoveredPackets () > 0 : sinkApp->GetRecoveredPackets () == 0,
+             "recovered packet count matches the r1-r3 losses");
+    }
+
+  Simulator::Destroy ();
+  return g_failed ? 1 : 0;
+}
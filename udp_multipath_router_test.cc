@@ -61,12 +61,16 @@ int
 main (int argc, char *argv[])
 {
   bool verbose = true;
+  bool weightedRoundRobin = false;
+  std::string tablesFile = "";
   uint32_t nCsma = 3;
 //  uint32_t nWifi = 3;
 
   CommandLine cmd;
   cmd.AddValue ("nCsma", "Number of \"extra\" CSMA nodes/devices", nCsma);
   cmd.AddValue ("verbose", "Tell echo applications to log if true", verbose);
+  cmd.AddValue ("weightedRoundRobin", "Split traffic across channels by capacity", weightedRoundRobin);
+  cmd.AddValue ("tablesFile", "Load the router tables from this file instead of the built-in ones", tablesFile);
 
   cmd.Parse (argc,argv);
 
@@ -212,37 +216,51 @@ main (int argc, char *argv[])
   // Setup Udp Multipath Router
   Ptr<UdpMultipathRouter> routingApp = CreateObject<UdpMultipathRouter> ();
 
-  routingApp->channelTable.AddChannelEntry( 0, 100 ); // CSMA Channel
-  routingApp->channelTable.AddChannelEntry( 1, 72 );  // Wi-Fi 2.4 GHZ Channel
-
-  routingApp->CreatePath(
-                          p2pInterfaces.GetAddress ( 0 ),  // source address
-                          9,                               // source port
-                          csmaInterfaces.GetAddress (2),   // destination address
-                          31,                              // destination port
-                          0,                               // destination node id
-                          0                                // channel id
-                        );
-
-  routingApp->CreatePath(
-                          p2pInterfaces.GetAddress ( 0 ),  // source address
-                          10,                              // source port
-                          csmaInterfaces.GetAddress(3),    // destination address
-                          32,                              // destination port
-                          1,                               // destination node id
-                          0                                // channel id
-                        );
-
-  routingApp->CreatePath( 
-                          p2pInterfaces.GetAddress ( 0 ),  // source address
-                          11,                              // source port
-                          staWifiInterfaces.GetAddress(0), // destination address
-                          33,                              // destination port
-                          1,                               // destination node id
-                          1                                // channel id
-                       );
-
-  routingApp->SetLoadBalancing(BalancingAlgorithm::TX_DROP_THRESHOLD);
+  if (!tablesFile.empty ())
+    {
+      routingApp->SetTablesFile (tablesFile);
+    }
+  else
+    {
+      routingApp->channelTable.AddChannelEntry( 0, 100 ); // CSMA Channel
+      routingApp->channelTable.AddChannelEntry( 1, 72 );  // Wi-Fi 2.4 GHZ Channel
+
+      routingApp->CreatePath(
+                              p2pInterfaces.GetAddress ( 0 ),  // source address
+                              9,                               // source port
+                              csmaInterfaces.GetAddress (2),   // destination address
+                              31,                              // destination port
+                              0,                               // destination node id
+                              0                                // channel id
+                            );
+
+      routingApp->CreatePath(
+                              p2pInterfaces.GetAddress ( 0 ),  // source address
+                              10,                              // source port
+                              csmaInterfaces.GetAddress(3),    // destination address
+                              32,                              // destination port
+                              1,                               // destination node id
+                              0                                // channel id
+                            );
+
+      routingApp->CreatePath( 
+                              p2pInterfaces.GetAddress ( 0 ),  // source address
+                              11,                              // source port
+                              staWifiInterfaces.GetAddress(0), // destination address
+                              33,                              // destination port
+                              1,                               // destination node id
+                              1                                // channel id
+                           );
+    }
+
+  if (weightedRoundRobin)
+    {
+      routingApp->SetLoadBalancing(BalancingAlgorithm::WEIGHTED_ROUND_ROBIN);
+    }
+  else
+    {
+      routingApp->SetLoadBalancing(BalancingAlgorithm::TX_DROP_THRESHOLD);
+    }
   routingApp->SetDropMode(DropMode::TX_DROP_THRESHOLD);
 
   p2pNodes.Get (1)->AddApplication(routingApp);
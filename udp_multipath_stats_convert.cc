@@ -0,0 +1,127 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "ns3/udp-multipath-stats.h"
+
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <vector>
+
+// Converts a channel stats file written by UdpMultipathRouter::SetStatsFile
+// to text, on standard output:
+//   csv      one line per record
+//   gnuplot  one line per refresh, channels side by side (like results/*_gnuplot.txt)
+//
+// usage: udp_multipath_stats_convert <stats file> [csv|gnuplot]
+
+using namespace ns3;
+
+static void
+WriteGnuplotRow (int64_t time_ns, const std::vector<ChannelStatsRecord> &row,
+                 const std::map<uint32_t, uint32_t> &columns)
+{
+  std::vector<const ChannelStatsRecord *> ordered (columns.size (), 0);
+  for (uint32_t i = 0; i < row.size (); i++)
+    {
+      ordered[columns.find (row[i].channel_id)->second] = &row[i];
+    }
+  std::cout << time_ns / 1000000;
+  for (uint32_t i = 0; i < ordered.size (); i++)
+    {
+      if (ordered[i] == 0)
+        {
+          std::cout << "\t0\t0\t0\t0";
+          continue;
+        }
+      std::cout << "\t" << ordered[i]->current_use / 1e6
+                << "\t" << ordered[i]->packets
+                << "\t" << ordered[i]->dropped_packets
+                << "\t" << ordered[i]->bytes;
+    }
+  std::cout << std::endl;
+}
+
+int
+main (int argc, char *argv[])
+{
+  if (argc < 2 || argc > 3
+      || (argc == 3 && std::strcmp (argv[2], "csv") != 0 && std::strcmp (argv[2], "gnuplot") != 0))
+    {
+      std::cerr << "usage: " << argv[0] << " <stats file> [csv|gnuplot]" << std::endl;
+      return 1;
+    }
+  bool gnuplot = argc == 3 && std::strcmp (argv[2], "gnuplot") == 0;
+
+  ChannelStatsReader reader;
+  if (!reader.Open (argv[1]))
+    {
+      std::cerr << argv[1] << ": not a channel stats file" << std::endl;
+      return 1;
+    }
+
+  ChannelStatsRecord record;
+  if (!gnuplot)
+    {
+      std::cout << "time_s,channel_id,capacity_bps,use_bps,bytes,packets,dropped_packets,dropped_bytes" << std::endl;
+      while (reader.Read (record))
+        {
+          std::cout << record.time_ns / 1e9 << "," << record.channel_id << "," << record.capacity
+                    << "," << record.current_use << "," << record.bytes << "," << record.packets
+                    << "," << record.dropped_packets << "," << record.dropped_bytes << std::endl;
+        }
+      return 0;
+    }
+
+  // Records of one refresh share their timestamp; the channel columns are
+  // fixed by a first pass so every row has the same layout
+  std::vector<ChannelStatsRecord> records;
+  std::map<uint32_t, uint32_t> columns; // channel id -> column group
+  while (reader.Read (record))
+    {
+      records.push_back (record);
+      columns.insert (std::make_pair (record.channel_id, 0));
+    }
+  uint32_t group = 0;
+  std::map<uint32_t, uint32_t>::iterator it;
+  std::cout << "# time_ms";
+  for (it = columns.begin (); it != columns.end (); ++it)
+    {
+      it->second = group++;
+      std::cout << "\tID-" << it->first << " use(Mbps) packets dropped bytes";
+    }
+  std::cout << std::endl;
+  if (!columns.empty ())
+    {
+      std::cout << "# plot 'file' u 1:2 w l t 'ID-" << columns.begin ()->first << " use'" << std::endl;
+    }
+
+  std::vector<ChannelStatsRecord> row;
+  for (uint32_t i = 0; i < records.size (); i++)
+    {
+      if (!row.empty () && records[i].time_ns != row.front ().time_ns)
+        {
+          WriteGnuplotRow (row.front ().time_ns, row, columns);
+          row.clear ();
+        }
+      row.push_back (records[i]);
+    }
+  if (!row.empty ())
+    {
+      WriteGnuplotRow (row.front ().time_ns, row, columns);
+    }
+  return 0;
+}